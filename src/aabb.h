@@ -0,0 +1,90 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "vec.h"
+
+typedef struct aabb
+{
+    vec3_t min;
+    vec3_t max;
+} aabb_t;
+
+static inline void aabb_copy(const aabb_t* src, aabb_t* dst)
+{
+    memcpy(dst, src, sizeof(aabb_t));
+}
+
+static inline void aabb_empty(aabb_t* aabb)
+{
+    vec3_fill(aabb->min, INFINITY);
+    vec3_fill(aabb->max, -INFINITY);
+}
+
+static inline void aabb_merge(const aabb_t* a1, const aabb_t* a2, aabb_t* out)
+{
+    vec3_min(a1->min, a2->min, out->min);
+    vec3_max(a1->max, a2->max, out->max);
+}
+
+static inline void aabb_grow(aabb_t* aabb, const vec3_t p)
+{
+    vec3_min(aabb->min, p, aabb->min);
+    vec3_max(aabb->max, p, aabb->max);
+}
+
+static inline void aabb_centroid(const aabb_t* aabb, vec3_t out)
+{
+    vec3_add(aabb->min, aabb->max, out);
+    vec3_mult(out, 0.5f, out);
+}
+
+static inline float aabb_surface_area(const aabb_t* aabb)
+{
+    vec3_t d;
+    vec3_sub(aabb->max, aabb->min, d);
+    return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static inline enum axis aabb_largest_axis(const aabb_t* a)
+{
+    vec3_t axis_lengths;
+    vec3_sub(a->max, a->min, axis_lengths);
+    if (axis_lengths[0] >= axis_lengths[1])
+    {
+        if (axis_lengths[0] >= axis_lengths[2]) return AXIS_X;
+        else return AXIS_Z;
+    }
+    else
+    {
+        if (axis_lengths[1] >= axis_lengths[2]) return AXIS_Y;
+        else return AXIS_Z;
+    }
+}
+
+// Surface area of the intersection of two boxes, or 0 when they only touch or are disjoint
+static inline float aabb_overlap_area(const aabb_t* a1, const aabb_t* a2)
+{
+    aabb_t overlap;
+    vec3_max(a1->min, a2->min, overlap.min);
+    vec3_min(a1->max, a2->max, overlap.max);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (overlap.min[axis] >= overlap.max[axis]) return 0.0f;
+    }
+    return aabb_surface_area(&overlap);
+}
+
+static inline void aabb_clip_axis(aabb_t* aabb, enum axis axis, float min, float max)
+{
+    aabb->min[axis] = fmaxf(aabb->min[axis], min);
+    aabb->max[axis] = fminf(aabb->max[axis], max);
+}
+
+static inline void aabb_pad(aabb_t* aabb)
+{
+    static const vec3_t pad = {0.0001f, 0.0001f, 0.0001f};
+    vec3_sub(aabb->min, pad, aabb->min);
+    vec3_add(aabb->max, pad, aabb->max);
+}
+
+#endif
@@ -0,0 +1,1231 @@
+#include "bvh.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils.h"
+
+// Subtrees smaller than this are always built on the thread that reached them
+#define BVH_PARALLEL_MIN_PRIMS 4096
+
+struct bvh_build_ref
+{
+    aabb_t aabb;
+    vec3_t centroid;
+    uint32_t index;
+};
+
+struct bvh_builder
+{
+    bvh_t* bvh;
+    struct bvh_build_ref* refs;
+    atomic_size_t num_nodes;
+#ifdef BVH_SPATIAL_SPLITS
+    // Spatial splits give each node its own reference array and leaves claim their prim_indices
+    // entries from num_prim_indices. num_refs counts references across the whole tree
+    atomic_size_t num_prim_indices;
+    atomic_size_t num_refs;
+    size_t max_refs;
+    atomic_size_t num_spatial_splits;
+    float inv_root_area;
+#endif
+};
+
+static void bvh_make_leaf(bvh_node_t* node, uint32_t start, uint32_t end)
+{
+    node->offset = start;
+    node->info = BVH_LEAF_FLAG | (end - start);
+}
+
+#if BVH_SPLIT_METHOD == BVH_SPLIT_MEDIAN
+static int ref_x_compare(const void* a, const void* b)
+{
+    const float v1 = ((struct bvh_build_ref*)a)->aabb.min[0];
+    const float v2 = ((struct bvh_build_ref*)b)->aabb.min[0];
+    if (v1 < v2) return -1;
+    if (v1 > v2) return 1;
+    return 0;
+}
+
+static int ref_y_compare(const void* a, const void* b)
+{
+    const float v1 = ((struct bvh_build_ref*)a)->aabb.min[1];
+    const float v2 = ((struct bvh_build_ref*)b)->aabb.min[1];
+    if (v1 < v2) return -1;
+    if (v1 > v2) return 1;
+    return 0;
+}
+
+static int ref_z_compare(const void* a, const void* b)
+{
+    const float v1 = ((struct bvh_build_ref*)a)->aabb.min[2];
+    const float v2 = ((struct bvh_build_ref*)b)->aabb.min[2];
+    if (v1 < v2) return -1;
+    if (v1 > v2) return 1;
+    return 0;
+}
+
+// Sorts [start, end) along its largest axis and returns the start of the right half. Only single
+// primitives become leaves
+static uint32_t bvh_partition_median(struct bvh_build_ref* refs, uint32_t start, uint32_t end, const aabb_t* bounds, enum axis* out_axis)
+{
+    typedef int (*comparator)(const void*, const void*);
+
+    static const comparator comparators[3] = {ref_x_compare, ref_y_compare, ref_z_compare};
+
+    if (end - start <= 1) return start;
+
+    *out_axis = aabb_largest_axis(bounds);
+    const comparator compare_func = comparators[*out_axis];
+    qsort(&refs[start], end - start, sizeof(struct bvh_build_ref), compare_func);
+    return start + (end - start) / 2;
+}
+#else
+struct sah_bin
+{
+    aabb_t aabb;
+    size_t count;
+};
+
+// A candidate split of a range into the bins at or below bin and those above it, binned along axis
+// starting at min with scale bins per unit. cost is INFINITY when nothing separates the range
+struct sah_split
+{
+    float cost;
+    int axis;
+    size_t bin;
+    float min;
+    float scale;
+    aabb_t left;
+    aabb_t right;
+};
+
+static size_t sah_bin_index(float value, float min, float scale)
+{
+    const float bin = (value - min) * scale;
+    if (bin <= 0.0f) return 0;
+    return bin < BVH_SAH_NUM_BINS ? (size_t) bin : BVH_SAH_NUM_BINS - 1;
+}
+
+// Sweeps bins from both ends and updates best with the cheapest boundary between them. A
+// reference's left count and right count can differ when it spans several bins
+static void sah_sweep_bins(const struct sah_bin* bins, const size_t* right_bin_counts, int axis, float min, float scale, float inv_parent_area, struct sah_split* best)
+{
+    // Sweep from the right to get the cost terms of every right half, then from the left
+    aabb_t right_aabbs[BVH_SAH_NUM_BINS - 1];
+    size_t right_counts[BVH_SAH_NUM_BINS - 1];
+    aabb_t acc;
+    size_t count = 0;
+    aabb_empty(&acc);
+    for (size_t b = BVH_SAH_NUM_BINS - 1; b > 0; b--)
+    {
+        aabb_merge(&acc, &bins[b].aabb, &acc);
+        count += right_bin_counts[b];
+        aabb_copy(&acc, &right_aabbs[b - 1]);
+        right_counts[b - 1] = count;
+    }
+
+    aabb_empty(&acc);
+    count = 0;
+    for (size_t b = 0; b < BVH_SAH_NUM_BINS - 1; b++)
+    {
+        aabb_merge(&acc, &bins[b].aabb, &acc);
+        count += bins[b].count;
+        if (count == 0 || right_counts[b] == 0) continue;
+
+        const float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * inv_parent_area *
+            (count * aabb_surface_area(&acc) + right_counts[b] * aabb_surface_area(&right_aabbs[b]));
+        if (cost < best->cost)
+        {
+            best->cost = cost;
+            best->axis = axis;
+            best->bin = b;
+            best->min = min;
+            best->scale = scale;
+            aabb_copy(&acc, &best->left);
+            aabb_copy(&right_aabbs[b], &best->right);
+        }
+    }
+}
+
+// Bins the centroids of [start, end) along each axis and finds the bin boundary with the lowest SAH cost
+static void bvh_find_object_split(const struct bvh_build_ref* refs, uint32_t start, uint32_t end, const aabb_t* bounds, struct sah_split* out)
+{
+    out->cost = INFINITY;
+    out->axis = -1;
+    if (end - start <= 1) return;
+
+    aabb_t centroid_bounds;
+    aabb_empty(&centroid_bounds);
+    for (uint32_t i = start; i < end; i++)
+    {
+        aabb_grow(&centroid_bounds, refs[i].centroid);
+    }
+
+    const float inv_parent_area = 1.0f / aabb_surface_area(bounds);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+        if (extent <= 0.0f) continue;
+        const float min = centroid_bounds.min[axis];
+        const float scale = BVH_SAH_NUM_BINS / extent;
+
+        struct sah_bin bins[BVH_SAH_NUM_BINS];
+        size_t counts[BVH_SAH_NUM_BINS];
+        for (size_t b = 0; b < BVH_SAH_NUM_BINS; b++)
+        {
+            aabb_empty(&bins[b].aabb);
+            bins[b].count = 0;
+        }
+        for (uint32_t i = start; i < end; i++)
+        {
+            struct sah_bin* bin = &bins[sah_bin_index(refs[i].centroid[axis], min, scale)];
+            aabb_merge(&bin->aabb, &refs[i].aabb, &bin->aabb);
+            bin->count++;
+        }
+        for (size_t b = 0; b < BVH_SAH_NUM_BINS; b++)
+        {
+            counts[b] = bins[b].count;
+        }
+        sah_sweep_bins(bins, counts, axis, min, scale, inv_parent_area, out);
+    }
+}
+
+// Partitions [start, end) around the split and returns the start of the right half
+static uint32_t bvh_apply_object_split(struct bvh_build_ref* refs, uint32_t start, uint32_t end, const struct sah_split* split)
+{
+    uint32_t i = start;
+    uint32_t j = end;
+    while (i < j)
+    {
+        if (sah_bin_index(refs[i].centroid[split->axis], split->min, split->scale) <= split->bin)
+        {
+            i++;
+        }
+        else
+        {
+            const struct bvh_build_ref tmp = refs[i];
+            refs[i] = refs[--j];
+            refs[j] = tmp;
+        }
+    }
+    return i;
+}
+
+// Picks the object split with the lowest SAH cost. If that is cheaper than intersecting every
+// primitive in [start, end), returns start to make a leaf. Otherwise partitions the range around the
+// split, writes its axis to out_axis and returns the start of the right half
+static uint32_t bvh_partition_sah(struct bvh_build_ref* refs, uint32_t start, uint32_t end, const aabb_t* bounds, enum axis* out_axis)
+{
+    const size_t num_refs = end - start;
+    if (num_refs <= 1) return start;
+
+    struct sah_split split;
+    bvh_find_object_split(refs, start, end, bounds, &split);
+
+    const float leaf_cost = BVH_INTERSECTION_COST * num_refs;
+    if (num_refs <= BVH_MAX_LEAF_SIZE && leaf_cost <= split.cost) return start;
+
+    // All centroids coincide, so any split is as good as another
+    if (split.axis < 0)
+    {
+        *out_axis = aabb_largest_axis(bounds);
+        return start + num_refs / 2;
+    }
+
+    *out_axis = split.axis;
+    return bvh_apply_object_split(refs, start, end, &split);
+}
+#endif
+
+struct bvh_build_task
+{
+    struct bvh_builder* builder;
+    uint32_t node_index;
+    uint32_t start;
+    uint32_t end;
+    int depth;
+    int spawn_depth;
+};
+
+static void bvh_build_node(struct bvh_builder* builder, uint32_t node_index, uint32_t start, uint32_t end, int depth, int spawn_depth);
+
+static void* bvh_build_task(void* _args)
+{
+    struct bvh_build_task* args = (struct bvh_build_task*) _args;
+    bvh_build_node(args->builder, args->node_index, args->start, args->end, args->depth, args->spawn_depth);
+    return NULL;
+}
+
+// Builds the subtree over refs [start, end) into node_index. Sibling pairs are claimed from a shared
+// atomic counter, so subtrees over disjoint ranges can be built concurrently into the same node array.
+// While spawn_depth is positive, the left subtree of a large range is handed to a new thread
+static void bvh_build_node(struct bvh_builder* builder, uint32_t node_index, uint32_t start, uint32_t end, int depth, int spawn_depth)
+{
+    bvh_node_t* node = &builder->bvh->nodes[node_index];
+    struct bvh_build_ref* refs = builder->refs;
+
+    aabb_copy(&refs[start].aabb, &node->aabb);
+    for (uint32_t i = start + 1; i < end; i++)
+    {
+        aabb_merge(&node->aabb, &refs[i].aabb, &node->aabb);
+    }
+
+    if (depth >= BVH_MAX_DEPTH)
+    {
+        bvh_make_leaf(node, start, end);
+        return;
+    }
+
+    enum axis axis;
+#if BVH_SPLIT_METHOD == BVH_SPLIT_MEDIAN
+    const uint32_t mid = bvh_partition_median(refs, start, end, &node->aabb, &axis);
+#else
+    const uint32_t mid = bvh_partition_sah(refs, start, end, &node->aabb, &axis);
+#endif
+    if (mid == start)
+    {
+        bvh_make_leaf(node, start, end);
+        return;
+    }
+
+    const uint32_t left = atomic_fetch_add_explicit(&builder->num_nodes, 2, memory_order_relaxed);
+    const uint32_t right = left + 1;
+    node->offset = left;
+    node->info = axis;
+
+    pthread_t thread;
+    bool spawned = false;
+    if (spawn_depth > 0 && end - start >= BVH_PARALLEL_MIN_PRIMS)
+    {
+        struct bvh_build_task task = {builder, left, start, mid, depth + 1, spawn_depth - 1};
+        spawned = pthread_create(&thread, NULL, bvh_build_task, &task) == 0;
+        if (spawned)
+        {
+            bvh_build_node(builder, right, mid, end, depth + 1, spawn_depth - 1);
+            pthread_join(thread, NULL);
+        }
+    }
+    if (!spawned)
+    {
+        bvh_build_node(builder, left, start, mid, depth + 1, spawn_depth - 1);
+        bvh_build_node(builder, right, mid, end, depth + 1, spawn_depth - 1);
+    }
+}
+
+#ifdef BVH_SPATIAL_SPLITS
+static float spatial_bin_position(const struct sah_split* split, size_t bin)
+{
+    return split->min + bin / split->scale;
+}
+
+// Bins the parts of each reference clipped to equal slabs of the node's bounds and finds the slab
+// boundary with the lowest SAH cost. A reference counts toward the left of every boundary after the
+// bin it enters in and the right of every boundary before the bin it exits in
+static void bvh_find_spatial_split(const struct bvh_build_ref* refs, size_t num_refs, const aabb_t* bounds, struct sah_split* out)
+{
+    out->cost = INFINITY;
+    out->axis = -1;
+
+    const float inv_parent_area = 1.0f / aabb_surface_area(bounds);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float extent = bounds->max[axis] - bounds->min[axis];
+        if (extent <= 0.0f) continue;
+        const struct sah_split slabs = {.min = bounds->min[axis], .scale = BVH_SAH_NUM_BINS / extent};
+
+        struct sah_bin bins[BVH_SAH_NUM_BINS];
+        size_t exits[BVH_SAH_NUM_BINS];
+        for (size_t b = 0; b < BVH_SAH_NUM_BINS; b++)
+        {
+            aabb_empty(&bins[b].aabb);
+            bins[b].count = 0;
+            exits[b] = 0;
+        }
+        for (size_t i = 0; i < num_refs; i++)
+        {
+            const aabb_t* aabb = &refs[i].aabb;
+            const size_t first = sah_bin_index(aabb->min[axis], slabs.min, slabs.scale);
+            const size_t last = sah_bin_index(aabb->max[axis], slabs.min, slabs.scale);
+            for (size_t b = first; b <= last; b++)
+            {
+                aabb_t clipped;
+                aabb_copy(aabb, &clipped);
+                aabb_clip_axis(&clipped, axis, spatial_bin_position(&slabs, b), spatial_bin_position(&slabs, b + 1));
+                aabb_merge(&bins[b].aabb, &clipped, &bins[b].aabb);
+            }
+            bins[first].count++;
+            exits[last]++;
+        }
+        sah_sweep_bins(bins, exits, axis, slabs.min, slabs.scale, inv_parent_area, out);
+    }
+}
+
+// References lying in the plane go left
+static bool spatial_ref_in_left(const struct bvh_build_ref* ref, int axis, float position)
+{
+    return ref->aabb.min[axis] < position || ref->aabb.max[axis] <= position;
+}
+
+static bool spatial_ref_in_right(const struct bvh_build_ref* ref, int axis, float position)
+{
+    return ref->aabb.max[axis] > position;
+}
+
+// Distributes refs to newly allocated left and right arrays, clipping references that straddle the
+// plane into both. Returns false, allocating nothing, when the duplicates would exceed the budget or
+// leave a side empty
+static bool bvh_apply_spatial_split(struct bvh_builder* builder, const struct bvh_build_ref* refs, size_t num_refs, const struct sah_split* split,
+    struct bvh_build_ref** out_left, size_t* out_num_left, struct bvh_build_ref** out_right, size_t* out_num_right)
+{
+    const int axis = split->axis;
+    const float position = spatial_bin_position(split, split->bin + 1);
+    size_t num_left = 0;
+    size_t num_right = 0;
+    for (size_t i = 0; i < num_refs; i++)
+    {
+        num_left += spatial_ref_in_left(&refs[i], axis, position);
+        num_right += spatial_ref_in_right(&refs[i], axis, position);
+    }
+    if (num_left == 0 || num_right == 0) return false;
+
+    const size_t num_duplicates = num_left + num_right - num_refs;
+    if (num_duplicates > 0)
+    {
+        const size_t total = atomic_fetch_add_explicit(&builder->num_refs, num_duplicates, memory_order_relaxed) + num_duplicates;
+        if (total > builder->max_refs)
+        {
+            atomic_fetch_sub_explicit(&builder->num_refs, num_duplicates, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    struct bvh_build_ref* left = malloc(sizeof(struct bvh_build_ref) * num_left);
+    struct bvh_build_ref* right = malloc(sizeof(struct bvh_build_ref) * num_right);
+    size_t l = 0;
+    size_t r = 0;
+    for (size_t i = 0; i < num_refs; i++)
+    {
+        const bool in_left = spatial_ref_in_left(&refs[i], axis, position);
+        const bool in_right = spatial_ref_in_right(&refs[i], axis, position);
+        if (in_left)
+        {
+            left[l] = refs[i];
+            if (in_right)
+            {
+                aabb_clip_axis(&left[l].aabb, axis, -INFINITY, position);
+                aabb_centroid(&left[l].aabb, left[l].centroid);
+            }
+            l++;
+        }
+        if (in_right)
+        {
+            right[r] = refs[i];
+            if (in_left)
+            {
+                aabb_clip_axis(&right[r].aabb, axis, position, INFINITY);
+                aabb_centroid(&right[r].aabb, right[r].centroid);
+            }
+            r++;
+        }
+    }
+    assert(l == num_left && r == num_right);
+
+    *out_left = left;
+    *out_num_left = num_left;
+    *out_right = right;
+    *out_num_right = num_right;
+    return true;
+}
+
+static void bvh_make_spatial_leaf(struct bvh_builder* builder, bvh_node_t* node, const struct bvh_build_ref* refs, size_t num_refs)
+{
+    const size_t offset = atomic_fetch_add_explicit(&builder->num_prim_indices, num_refs, memory_order_relaxed);
+    for (size_t i = 0; i < num_refs; i++)
+    {
+        builder->bvh->prim_indices[offset + i] = refs[i].index;
+    }
+    bvh_make_leaf(node, offset, offset + num_refs);
+}
+
+struct bvh_spatial_build_task
+{
+    struct bvh_builder* builder;
+    uint32_t node_index;
+    struct bvh_build_ref* refs;
+    size_t num_refs;
+    int depth;
+    int spawn_depth;
+    float overlap_removed;
+};
+
+static float bvh_build_node_spatial(struct bvh_builder* builder, uint32_t node_index, struct bvh_build_ref* refs, size_t num_refs, int depth, int spawn_depth);
+
+static void* bvh_spatial_build_task(void* _args)
+{
+    struct bvh_spatial_build_task* args = (struct bvh_spatial_build_task*) _args;
+    args->overlap_removed = bvh_build_node_spatial(args->builder, args->node_index, args->refs, args->num_refs, args->depth, args->spawn_depth);
+    return NULL;
+}
+
+// Like bvh_build_node, but the node owns and frees refs, and its children get arrays of their own
+// since spatial splits can grow them. Returns the child overlap the subtree's spatial splits removed,
+// relative to the root's surface area
+static float bvh_build_node_spatial(struct bvh_builder* builder, uint32_t node_index, struct bvh_build_ref* refs, size_t num_refs, int depth, int spawn_depth)
+{
+    bvh_node_t* node = &builder->bvh->nodes[node_index];
+
+    aabb_copy(&refs[0].aabb, &node->aabb);
+    for (size_t i = 1; i < num_refs; i++)
+    {
+        aabb_merge(&node->aabb, &refs[i].aabb, &node->aabb);
+    }
+
+    struct sah_split object;
+    struct sah_split spatial = {.cost = INFINITY, .axis = -1};
+    bvh_find_object_split(refs, 0, num_refs, &node->aabb, &object);
+    const float object_overlap = object.axis < 0 ? INFINITY : aabb_overlap_area(&object.left, &object.right) * builder->inv_root_area;
+    if (num_refs > 1 && object_overlap > BVH_SPATIAL_SPLIT_ALPHA)
+    {
+        bvh_find_spatial_split(refs, num_refs, &node->aabb, &spatial);
+    }
+
+    const float leaf_cost = BVH_INTERSECTION_COST * num_refs;
+    if (depth >= BVH_MAX_DEPTH || num_refs <= 1 ||
+        (num_refs <= BVH_MAX_LEAF_SIZE && leaf_cost <= fminf(object.cost, spatial.cost)))
+    {
+        bvh_make_spatial_leaf(builder, node, refs, num_refs);
+        free(refs);
+        return 0.0f;
+    }
+
+    struct bvh_build_ref* left_refs;
+    struct bvh_build_ref* right_refs;
+    size_t num_left, num_right;
+    float overlap_removed = 0.0f;
+    enum axis axis;
+    if (spatial.cost < object.cost &&
+        bvh_apply_spatial_split(builder, refs, num_refs, &spatial, &left_refs, &num_left, &right_refs, &num_right))
+    {
+        axis = spatial.axis;
+        atomic_fetch_add_explicit(&builder->num_spatial_splits, 1, memory_order_relaxed);
+        // With all centroids coinciding there is no object split to compare against
+        if (object.axis >= 0)
+        {
+            overlap_removed = object_overlap - aabb_overlap_area(&spatial.left, &spatial.right) * builder->inv_root_area;
+        }
+    }
+    else
+    {
+        uint32_t mid;
+        if (object.axis < 0)
+        {
+            axis = aabb_largest_axis(&node->aabb);
+            mid = num_refs / 2;
+        }
+        else
+        {
+            axis = object.axis;
+            mid = bvh_apply_object_split(refs, 0, num_refs, &object);
+        }
+        num_left = mid;
+        num_right = num_refs - mid;
+        left_refs = malloc(sizeof(struct bvh_build_ref) * num_left);
+        right_refs = malloc(sizeof(struct bvh_build_ref) * num_right);
+        memcpy(left_refs, refs, sizeof(struct bvh_build_ref) * num_left);
+        memcpy(right_refs, refs + mid, sizeof(struct bvh_build_ref) * num_right);
+    }
+    free(refs);
+
+    const uint32_t left = atomic_fetch_add_explicit(&builder->num_nodes, 2, memory_order_relaxed);
+    const uint32_t right = left + 1;
+    node->offset = left;
+    node->info = axis;
+
+    pthread_t thread;
+    bool spawned = false;
+    if (spawn_depth > 0 && num_refs >= BVH_PARALLEL_MIN_PRIMS)
+    {
+        struct bvh_spatial_build_task task = {builder, left, left_refs, num_left, depth + 1, spawn_depth - 1, 0.0f};
+        spawned = pthread_create(&thread, NULL, bvh_spatial_build_task, &task) == 0;
+        if (spawned)
+        {
+            overlap_removed += bvh_build_node_spatial(builder, right, right_refs, num_right, depth + 1, spawn_depth - 1);
+            pthread_join(thread, NULL);
+            overlap_removed += task.overlap_removed;
+        }
+    }
+    if (!spawned)
+    {
+        overlap_removed += bvh_build_node_spatial(builder, left, left_refs, num_left, depth + 1, spawn_depth - 1);
+        overlap_removed += bvh_build_node_spatial(builder, right, right_refs, num_right, depth + 1, spawn_depth - 1);
+    }
+    return overlap_removed;
+}
+#endif
+
+#if BVH_WIDTH == 4
+static void bvh4_node_set_child(bvh4_node_t* node, int i, const aabb_t* aabb, uint32_t child, uint32_t count)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node->bounds[0][axis][i] = aabb->min[axis];
+        node->bounds[1][axis][i] = aabb->max[axis];
+    }
+    node->children[i] = child;
+    node->counts[i] = count;
+}
+
+static void bvh4_node_set_child_from_binary(bvh4_node_t* node, int i, const bvh_node_t* binary, uint32_t interior_index)
+{
+    if (bvh_node_is_leaf(binary))
+    {
+        bvh4_node_set_child(node, i, &binary->aabb, binary->offset, bvh_node_count(binary));
+    }
+    else
+    {
+        bvh4_node_set_child(node, i, &binary->aabb, interior_index, 0);
+    }
+}
+
+static void bvh4_node_clear_child(bvh4_node_t* node, int i)
+{
+    const aabb_t never_hit = {{INFINITY, INFINITY, INFINITY}, {INFINITY, INFINITY, INFINITY}};
+    bvh4_node_set_child(node, i, &never_hit, 0, 0);
+}
+
+// Pulls up to four descendants of a binary interior node into one bvh4 node by repeatedly opening
+// the interior child with the largest surface area, then collapses the remaining interior children
+static uint32_t bvh4_collapse_node(bvh_t* self, uint32_t binary_index)
+{
+    const uint32_t node_index = self->num_bvh4_nodes++;
+    const bvh_node_t* binary = &self->nodes[binary_index];
+
+    uint32_t open[4] = {binary->offset, binary->offset + 1};
+    int num_open = 2;
+    while (num_open < 4)
+    {
+        int best = -1;
+        float best_area = -INFINITY;
+        for (int i = 0; i < num_open; i++)
+        {
+            const bvh_node_t* child = &self->nodes[open[i]];
+            if (bvh_node_is_leaf(child)) continue;
+            const float area = aabb_surface_area(&child->aabb);
+            if (area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) break;
+
+        const bvh_node_t* opened = &self->nodes[open[best]];
+        open[best] = opened->offset;
+        open[num_open++] = opened->offset + 1;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (i >= num_open)
+        {
+            bvh4_node_clear_child(&self->bvh4_nodes[node_index], i);
+            continue;
+        }
+        const bvh_node_t* child = &self->nodes[open[i]];
+        const uint32_t interior_index = bvh_node_is_leaf(child) ? 0 : bvh4_collapse_node(self, open[i]);
+        bvh4_node_set_child_from_binary(&self->bvh4_nodes[node_index], i, child, interior_index);
+    }
+    return node_index;
+}
+
+static void bvh4_build(bvh_t* self)
+{
+    // A bvh4 node always replaces at least one binary interior node, of which there are fewer than half
+    const size_t capacity = self->num_nodes / 2 + 1;
+    self->bvh4_nodes = aligned_alloc(_Alignof(bvh4_node_t), sizeof(bvh4_node_t) * capacity);
+    self->num_bvh4_nodes = 0;
+
+    const bvh_node_t* root = &self->nodes[0];
+    if (bvh_node_is_leaf(root))
+    {
+        bvh4_node_t* node = &self->bvh4_nodes[self->num_bvh4_nodes++];
+        bvh4_node_set_child_from_binary(node, 0, root, 0);
+        for (int i = 1; i < 4; i++)
+        {
+            bvh4_node_clear_child(node, i);
+        }
+        return;
+    }
+    bvh4_collapse_node(self, 0);
+}
+
+static bool bvh4_node_child_is_used(const bvh4_node_t* node, int i)
+{
+    // The root is never a child, so index 0 with no primitives marks a cleared lane
+    return node->children[i] != 0 || node->counts[i] != 0;
+}
+
+// Collapsed nodes are numbered before their children, so a reverse sweep refits every child before
+// the node that holds its box
+static void bvh4_refit(bvh_t* self, const aabb_t* prim_aabbs)
+{
+    for (size_t n = self->num_bvh4_nodes; n-- > 0;)
+    {
+        bvh4_node_t* node = &self->bvh4_nodes[n];
+        for (int i = 0; i < 4; i++)
+        {
+            if (!bvh4_node_child_is_used(node, i)) continue;
+
+            aabb_t aabb;
+            aabb_empty(&aabb);
+            if (node->counts[i] > 0)
+            {
+                const uint32_t end = node->children[i] + node->counts[i];
+                for (uint32_t j = node->children[i]; j < end; j++)
+                {
+                    aabb_merge(&aabb, &prim_aabbs[self->prim_indices[j]], &aabb);
+                }
+            }
+            else
+            {
+                const bvh4_node_t* child = &self->bvh4_nodes[node->children[i]];
+                for (int k = 0; k < 4; k++)
+                {
+                    if (!bvh4_node_child_is_used(child, k)) continue;
+                    const aabb_t child_aabb = {
+                        {child->bounds[0][0][k], child->bounds[0][1][k], child->bounds[0][2][k]},
+                        {child->bounds[1][0][k], child->bounds[1][1][k], child->bounds[1][2][k]}
+                    };
+                    aabb_merge(&aabb, &child_aabb, &aabb);
+                }
+            }
+            bvh4_node_set_child(node, i, &aabb, node->children[i], node->counts[i]);
+        }
+    }
+}
+#endif
+
+static float bvh_node_sah_cost(const bvh_t* self, uint32_t node_index)
+{
+    const bvh_node_t* node = &self->nodes[node_index];
+    const float area = aabb_surface_area(&node->aabb);
+    if (bvh_node_is_leaf(node))
+    {
+        return BVH_INTERSECTION_COST * bvh_node_count(node) * area;
+    }
+    return BVH_TRAVERSAL_COST * area +
+        bvh_node_sah_cost(self, node->offset) +
+        bvh_node_sah_cost(self, node->offset + 1);
+}
+
+void bvh_init(bvh_t* self)
+{
+    self->nodes = NULL;
+    self->num_nodes = 0;
+    self->prim_indices = NULL;
+    self->num_prim_indices = 0;
+    self->num_prims = 0;
+#if BVH_WIDTH == 4
+    self->bvh4_nodes = NULL;
+    self->num_bvh4_nodes = 0;
+#endif
+    self->build_sah_cost = 0.0f;
+    self->mapping = NULL;
+    self->mapping_size = 0;
+#ifdef BVH_SPATIAL_SPLITS
+    self->num_spatial_splits = 0;
+    self->spatial_overlap_removed = 0.0f;
+#endif
+}
+
+void bvh_build(bvh_t* self, const aabb_t* prim_aabbs, size_t num_prims)
+{
+    bvh_destroy(self);
+    bvh_init(self);
+    if (num_prims == 0) return;
+    assert(num_prims < BVH_LEAF_FLAG);
+
+    struct bvh_builder builder;
+    builder.bvh = self;
+    builder.refs = malloc(sizeof(struct bvh_build_ref) * num_prims);
+    atomic_init(&builder.num_nodes, 1);
+    for (size_t i = 0; i < num_prims; i++)
+    {
+        struct bvh_build_ref* ref = &builder.refs[i];
+        aabb_copy(&prim_aabbs[i], &ref->aabb);
+        aabb_centroid(&ref->aabb, ref->centroid);
+        ref->index = i;
+    }
+
+    self->num_prims = num_prims;
+
+    // Enough spawn levels to give every core at least two subtrees
+    int spawn_depth = 0;
+    for (size_t tasks = 1; tasks < 2 * get_num_cpus(); tasks *= 2)
+    {
+        spawn_depth++;
+    }
+
+#ifdef BVH_SPATIAL_SPLITS
+    builder.max_refs = num_prims + (size_t) (num_prims * BVH_SPATIAL_SPLIT_BUDGET);
+    atomic_init(&builder.num_refs, num_prims);
+    atomic_init(&builder.num_prim_indices, 0);
+    atomic_init(&builder.num_spatial_splits, 0);
+    aabb_t root_bounds;
+    aabb_empty(&root_bounds);
+    for (size_t i = 0; i < num_prims; i++)
+    {
+        aabb_merge(&root_bounds, &prim_aabbs[i], &root_bounds);
+    }
+    builder.inv_root_area = 1.0f / aabb_surface_area(&root_bounds);
+
+    // Every leaf holds at least one reference
+    self->nodes = malloc(sizeof(bvh_node_t) * (2 * builder.max_refs - 1));
+    self->prim_indices = malloc(sizeof(uint32_t) * builder.max_refs);
+    self->spatial_overlap_removed = bvh_build_node_spatial(&builder, 0, builder.refs, num_prims, 0, spawn_depth);
+    self->num_nodes = atomic_load(&builder.num_nodes);
+    self->num_prim_indices = atomic_load(&builder.num_prim_indices);
+    self->num_spatial_splits = atomic_load(&builder.num_spatial_splits);
+#else
+    // A binary tree with at most one leaf per primitive has at most 2n - 1 nodes
+    self->nodes = malloc(sizeof(bvh_node_t) * (2 * num_prims - 1));
+    bvh_build_node(&builder, 0, 0, num_prims, 0, spawn_depth);
+    self->num_nodes = atomic_load(&builder.num_nodes);
+
+    self->prim_indices = malloc(sizeof(uint32_t) * num_prims);
+    self->num_prim_indices = num_prims;
+    for (size_t i = 0; i < num_prims; i++)
+    {
+        self->prim_indices[i] = builder.refs[i].index;
+    }
+    free(builder.refs);
+#endif
+
+#if BVH_WIDTH == 4
+    bvh4_build(self);
+#endif
+    self->build_sah_cost = bvh_sah_cost(self);
+}
+
+float bvh_sah_cost(const bvh_t* self)
+{
+    if (self->num_nodes == 0) return 0.0f;
+    return bvh_node_sah_cost(self, 0) / aabb_surface_area(&self->nodes[0].aabb);
+}
+
+static float bvh_node_overlap(const bvh_t* self, uint32_t node_index)
+{
+    const bvh_node_t* node = &self->nodes[node_index];
+    if (bvh_node_is_leaf(node)) return 0.0f;
+    return aabb_overlap_area(&self->nodes[node->offset].aabb, &self->nodes[node->offset + 1].aabb) +
+        bvh_node_overlap(self, node->offset) +
+        bvh_node_overlap(self, node->offset + 1);
+}
+
+float bvh_overlap(const bvh_t* self)
+{
+    if (self->num_nodes == 0) return 0.0f;
+    return bvh_node_overlap(self, 0) / aabb_surface_area(&self->nodes[0].aabb);
+}
+
+float bvh_refit(bvh_t* self, const aabb_t* prim_aabbs)
+{
+    // Both children of a node are claimed after the node itself, so a reverse sweep visits children
+    // before their parents
+    for (size_t n = self->num_nodes; n-- > 0;)
+    {
+        bvh_node_t* node = &self->nodes[n];
+        if (bvh_node_is_leaf(node))
+        {
+            aabb_empty(&node->aabb);
+            const uint32_t end = node->offset + bvh_node_count(node);
+            for (uint32_t i = node->offset; i < end; i++)
+            {
+                aabb_merge(&node->aabb, &prim_aabbs[self->prim_indices[i]], &node->aabb);
+            }
+        }
+        else
+        {
+            aabb_merge(&self->nodes[node->offset].aabb, &self->nodes[node->offset + 1].aabb, &node->aabb);
+        }
+    }
+#if BVH_WIDTH == 4
+    bvh4_refit(self, prim_aabbs);
+#endif
+    return bvh_sah_cost(self);
+}
+
+void bvh_destroy(bvh_t* self)
+{
+    if (self->mapping)
+    {
+        munmap(self->mapping, self->mapping_size);
+        return;
+    }
+    free(self->nodes);
+    free(self->prim_indices);
+#if BVH_WIDTH == 4
+    free(self->bvh4_nodes);
+#endif
+}
+
+#define BVH_CACHE_MAGIC "rt-bvh"
+// Sections start on cache line boundaries, which also satisfies the alignment of bvh4_node_t
+#define BVH_CACHE_ALIGNMENT 64
+
+// Every field is 8 bytes so the layout has no padding. Offsets are from the start of the file
+struct bvh_cache_header
+{
+    char magic[8];
+    uint64_t version;
+    uint64_t key;
+    uint64_t file_size;
+    uint64_t num_prims;
+    uint64_t num_nodes;
+    uint64_t nodes_offset;
+    uint64_t num_prim_indices;
+    uint64_t prim_indices_offset;
+    uint64_t num_bvh4_nodes;
+    uint64_t bvh4_nodes_offset;
+    double build_sah_cost;
+    uint64_t num_spatial_splits;
+    double spatial_overlap_removed;
+};
+
+// Everything besides the primitive bounds that changes the tree bvh_build produces or how it is laid out
+struct bvh_cache_settings
+{
+    uint32_t version;
+    uint32_t width;
+    uint32_t node_size;
+    uint32_t split_method;
+    uint32_t num_bins;
+    uint32_t max_leaf_size;
+    uint32_t max_depth;
+    uint32_t spatial_splits;
+    float traversal_cost;
+    float intersection_cost;
+    float spatial_split_alpha;
+    float spatial_split_budget;
+};
+
+static uint64_t bvh_cache_align(uint64_t offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) & ~(uint64_t) (BVH_CACHE_ALIGNMENT - 1);
+}
+
+uint64_t bvh_cache_key(const aabb_t* prim_aabbs, size_t num_prims)
+{
+    const struct bvh_cache_settings settings = {
+        .version = BVH_CACHE_VERSION,
+        .width = BVH_WIDTH,
+        .node_size = sizeof(bvh_node_t),
+        .split_method = BVH_SPLIT_METHOD,
+        .num_bins = BVH_SAH_NUM_BINS,
+        .max_leaf_size = BVH_MAX_LEAF_SIZE,
+        .max_depth = BVH_MAX_DEPTH,
+#ifdef BVH_SPATIAL_SPLITS
+        .spatial_splits = 1,
+#else
+        .spatial_splits = 0,
+#endif
+        .traversal_cost = BVH_TRAVERSAL_COST,
+        .intersection_cost = BVH_INTERSECTION_COST,
+        .spatial_split_alpha = BVH_SPATIAL_SPLIT_ALPHA,
+        .spatial_split_budget = BVH_SPATIAL_SPLIT_BUDGET
+    };
+    const uint64_t count = num_prims;
+    uint64_t hash = hash_bytes(&settings, sizeof(settings), HASH_SEED);
+    hash = hash_bytes(&count, sizeof(count), hash);
+    return hash_bytes(prim_aabbs, sizeof(aabb_t) * num_prims, hash);
+}
+
+static bool bvh_cache_write(FILE* file, uint64_t offset, const void* data, size_t size)
+{
+    if (size == 0) return true;
+    return fseek(file, (long) offset, SEEK_SET) == 0 && fwrite(data, 1, size, file) == size;
+}
+
+bool bvh_save(const bvh_t* self, const char* path, uint64_t key)
+{
+    struct bvh_cache_header header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.key = key;
+    header.num_prims = self->num_prims;
+    header.num_nodes = self->num_nodes;
+    header.num_prim_indices = self->num_prim_indices;
+    header.build_sah_cost = self->build_sah_cost;
+    header.nodes_offset = bvh_cache_align(sizeof(header));
+    header.prim_indices_offset = bvh_cache_align(header.nodes_offset + sizeof(bvh_node_t) * header.num_nodes);
+    header.bvh4_nodes_offset = bvh_cache_align(header.prim_indices_offset + sizeof(uint32_t) * header.num_prim_indices);
+    header.file_size = header.bvh4_nodes_offset;
+#if BVH_WIDTH == 4
+    header.num_bvh4_nodes = self->num_bvh4_nodes;
+    header.file_size += sizeof(bvh4_node_t) * header.num_bvh4_nodes;
+#endif
+#ifdef BVH_SPATIAL_SPLITS
+    header.num_spatial_splits = self->num_spatial_splits;
+    header.spatial_overlap_removed = self->spatial_overlap_removed;
+#endif
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid()) >= (int) sizeof(tmp_path)) return false;
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) return false;
+
+    bool success =
+        bvh_cache_write(file, 0, &header, sizeof(header)) &&
+        bvh_cache_write(file, header.nodes_offset, self->nodes, sizeof(bvh_node_t) * header.num_nodes) &&
+        bvh_cache_write(file, header.prim_indices_offset, self->prim_indices, sizeof(uint32_t) * header.num_prim_indices);
+#if BVH_WIDTH == 4
+    success = success && bvh_cache_write(file, header.bvh4_nodes_offset, self->bvh4_nodes, sizeof(bvh4_node_t) * header.num_bvh4_nodes);
+#endif
+    // Padding after the last section is never written, so extend the file to its full size
+    success = success && fflush(file) == 0 && ftruncate(fileno(file), (off_t) header.file_size) == 0;
+    success = fclose(file) == 0 && success;
+
+    if (success && rename(tmp_path, path) == 0) return true;
+    remove(tmp_path);
+    return false;
+}
+
+static bool bvh_cache_section_valid(const struct bvh_cache_header* header, uint64_t offset, uint64_t count, size_t element_size)
+{
+    return offset % BVH_CACHE_ALIGNMENT == 0 &&
+        offset >= sizeof(struct bvh_cache_header) &&
+        offset <= header->file_size &&
+        count <= (header->file_size - offset) / element_size;
+}
+
+static bool bvh_cache_header_valid(const struct bvh_cache_header* header, uint64_t key, size_t file_size)
+{
+    if (strncmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != BVH_CACHE_VERSION || header->key != key || header->file_size != file_size) return false;
+    if (header->num_nodes == 0) return false;
+#if BVH_WIDTH == 4
+    if (!bvh_cache_section_valid(header, header->bvh4_nodes_offset, header->num_bvh4_nodes, sizeof(bvh4_node_t))) return false;
+#endif
+    return bvh_cache_section_valid(header, header->nodes_offset, header->num_nodes, sizeof(bvh_node_t)) &&
+        bvh_cache_section_valid(header, header->prim_indices_offset, header->num_prim_indices, sizeof(uint32_t));
+}
+
+struct bvh_cache_walk_entry
+{
+    uint32_t node;
+    uint32_t depth;
+};
+
+// Walks the binary tree from the root, checking that every node is reached once, within the depth the
+// traversal stacks are sized for, and that every index it follows stays inside its array
+static bool bvh_cache_nodes_valid(const bvh_t* self)
+{
+    struct bvh_cache_walk_entry stack[BVH_STACK_SIZE];
+    bool* visited = calloc(self->num_nodes, sizeof(bool));
+    bool valid = true;
+
+    size_t stack_len = 0;
+    stack[stack_len++] = (struct bvh_cache_walk_entry) {0, 0};
+    while (valid && stack_len > 0)
+    {
+        const struct bvh_cache_walk_entry entry = stack[--stack_len];
+        const bvh_node_t* node = &self->nodes[entry.node];
+        if (visited[entry.node] || entry.depth > BVH_MAX_DEPTH)
+        {
+            valid = false;
+        }
+        else if (bvh_node_is_leaf(node))
+        {
+            valid = node->offset <= self->num_prim_indices &&
+                bvh_node_count(node) <= self->num_prim_indices - node->offset;
+        }
+        else
+        {
+            valid = node->info < 3 && node->offset < self->num_nodes - 1;
+            if (valid)
+            {
+                stack[stack_len++] = (struct bvh_cache_walk_entry) {node->offset, entry.depth + 1};
+                stack[stack_len++] = (struct bvh_cache_walk_entry) {node->offset + 1, entry.depth + 1};
+            }
+        }
+        visited[entry.node] = true;
+    }
+    free(visited);
+    return valid;
+}
+
+#if BVH_WIDTH == 4
+// Same walk over the collapsed tree. Cleared lanes are skipped, which leaves a box at infinity for
+// the traversal to reject
+static bool bvh4_cache_nodes_valid(const bvh_t* self)
+{
+    if (self->num_bvh4_nodes == 0) return false;
+
+    struct bvh_cache_walk_entry stack[BVH4_STACK_SIZE];
+    bool* visited = calloc(self->num_bvh4_nodes, sizeof(bool));
+    bool valid = true;
+
+    size_t stack_len = 0;
+    stack[stack_len++] = (struct bvh_cache_walk_entry) {0, 0};
+    while (valid && stack_len > 0)
+    {
+        const struct bvh_cache_walk_entry entry = stack[--stack_len];
+        const bvh4_node_t* node = &self->bvh4_nodes[entry.node];
+        valid = !visited[entry.node] && entry.depth <= BVH_MAX_DEPTH;
+        visited[entry.node] = true;
+        for (int i = 0; valid && i < 4; i++)
+        {
+            if (!bvh4_node_child_is_used(node, i)) continue;
+            if (node->counts[i] > 0)
+            {
+                valid = node->children[i] <= self->num_prim_indices &&
+                    node->counts[i] <= self->num_prim_indices - node->children[i];
+            }
+            else
+            {
+                valid = node->children[i] < self->num_bvh4_nodes;
+                if (valid) stack[stack_len++] = (struct bvh_cache_walk_entry) {node->children[i], entry.depth + 1};
+            }
+        }
+    }
+    free(visited);
+    return valid;
+}
+#endif
+
+// The header only vouches for the section sizes, so the contents are checked before any traversal
+// indexes through them
+static bool bvh_cache_contents_valid(const bvh_t* self)
+{
+    for (size_t i = 0; i < self->num_prim_indices; i++)
+    {
+        if (self->prim_indices[i] >= self->num_prims) return false;
+    }
+#if BVH_WIDTH == 4
+    if (!bvh4_cache_nodes_valid(self)) return false;
+#endif
+    return bvh_cache_nodes_valid(self);
+}
+
+bool bvh_load(bvh_t* self, const char* path, uint64_t key, size_t num_prims)
+{
+    bvh_destroy(self);
+    bvh_init(self);
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat file_stat;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && (size_t) file_stat.st_size >= sizeof(struct bvh_cache_header))
+    {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const struct bvh_cache_header* header = mapping;
+    if (!bvh_cache_header_valid(header, key, file_stat.st_size) || header->num_prims != num_prims)
+    {
+        munmap(mapping, file_stat.st_size);
+        return false;
+    }
+
+    char* base = mapping;
+    self->mapping = mapping;
+    self->mapping_size = file_stat.st_size;
+    self->nodes = (bvh_node_t*) (base + header->nodes_offset);
+    self->num_nodes = header->num_nodes;
+    self->prim_indices = (uint32_t*) (base + header->prim_indices_offset);
+    self->num_prim_indices = header->num_prim_indices;
+    self->num_prims = header->num_prims;
+#if BVH_WIDTH == 4
+    self->bvh4_nodes = (bvh4_node_t*) (base + header->bvh4_nodes_offset);
+    self->num_bvh4_nodes = header->num_bvh4_nodes;
+#endif
+    self->build_sah_cost = header->build_sah_cost;
+#ifdef BVH_SPATIAL_SPLITS
+    self->num_spatial_splits = header->num_spatial_splits;
+    self->spatial_overlap_removed = header->spatial_overlap_removed;
+#endif
+    if (!bvh_cache_contents_valid(self))
+    {
+        bvh_destroy(self);
+        bvh_init(self);
+        return false;
+    }
+    return true;
+}
+
+struct bvh_cache_file
+{
+    char name[256];
+    time_t mtime;
+    size_t size;
+};
+
+static int bvh_cache_file_compare(const void* a, const void* b)
+{
+    const time_t mtime_a = ((const struct bvh_cache_file*) a)->mtime;
+    const time_t mtime_b = ((const struct bvh_cache_file*) b)->mtime;
+    return (mtime_a > mtime_b) - (mtime_a < mtime_b);
+}
+
+void bvh_cache_trim(const char* dir, size_t max_bytes)
+{
+    DIR* handle = opendir(dir);
+    if (!handle) return;
+
+    struct bvh_cache_file* files = NULL;
+    size_t num_files = 0;
+    size_t capacity = 0;
+    size_t total_size = 0;
+    char path[4096];
+    const struct dirent* entry;
+    while ((entry = readdir(handle)))
+    {
+        // Only finished trees count, so a temporary file another run is still writing is left alone
+        const size_t length = strlen(entry->d_name);
+        if (length < 4 || length >= sizeof(files->name) || strcmp(entry->d_name + length - 4, ".bvh") != 0) continue;
+
+        struct stat file_stat;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) continue;
+
+        if (num_files == capacity)
+        {
+            const size_t new_capacity = capacity ? capacity * 2 : 64;
+            struct bvh_cache_file* new_files = realloc(files, sizeof(struct bvh_cache_file) * new_capacity);
+            if (!new_files) break;
+            files = new_files;
+            capacity = new_capacity;
+        }
+        struct bvh_cache_file* file = &files[num_files++];
+        memcpy(file->name, entry->d_name, length + 1);
+        file->mtime = file_stat.st_mtime;
+        file->size = file_stat.st_size;
+        total_size += file->size;
+    }
+    closedir(handle);
+    if (total_size <= max_bytes)
+    {
+        free(files);
+        return;
+    }
+
+    qsort(files, num_files, sizeof(struct bvh_cache_file), bvh_cache_file_compare);
+    for (size_t i = 0; i < num_files && total_size > max_bytes; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+        if (remove(path) == 0) total_size -= files[i].size;
+    }
+    free(files);
+}
@@ -0,0 +1,200 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.h"
+#include "aabb.h"
+
+// Branching factor of the BVH used for traversal. A width of 4 collapses the binary tree into nodes
+// whose four child boxes are tested at once
+#ifndef BVH_WIDTH
+    #define BVH_WIDTH 4
+#endif
+
+// Counts rays and visited nodes during traversal, see scene_bvh_stats
+//#define BVH_STATS
+
+#define BVH_SPLIT_MEDIAN 0
+#define BVH_SPLIT_SAH 1
+#ifndef BVH_SPLIT_METHOD
+    #define BVH_SPLIT_METHOD BVH_SPLIT_SAH
+#endif
+#define BVH_SAH_NUM_BINS 16
+
+// Lets the SAH builder split space as well as objects. References to primitives that straddle the
+// plane go to both children, each clipped to its side, which tightens the boxes around large and
+// overlapping primitives at the cost of a bigger tree. Requires BVH_SPLIT_SAH
+//#define BVH_SPATIAL_SPLITS
+// Spatial splits are only searched for where the best object split's children overlap by more than
+// this fraction of the root's surface area
+#define BVH_SPATIAL_SPLIT_ALPHA 1e-5f
+// Extra references spatial splits may add, as a fraction of the primitive count
+#define BVH_SPATIAL_SPLIT_BUDGET 1.0f
+// Relative costs of visiting an interior node and testing one primitive, used by the SAH
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 0.5f
+// Leaves are only made larger than this when the depth limit is reached
+#define BVH_MAX_LEAF_SIZE 4
+// Bounds the traversal stacks: a binary traversal never holds more than depth + 1 entries
+#define BVH_MAX_DEPTH 48
+#define BVH_STACK_SIZE 64
+
+// A refit keeps the tree's topology, so its quality degrades as primitives move. Once the SAH cost
+// exceeds the cost at build time by this factor, scene_refit_bvh rebuilds instead
+#define BVH_REFIT_MAX_COST_RATIO 1.3f
+
+// Environment variable naming the directory that built trees are saved to, so later runs over the same
+// primitive bounds map the file instead of building. Trees are always built when it is unset
+#define BVH_CACHE_DIR_ENV "RT_BVH_CACHE_DIR"
+// Smaller trees build faster than their file is found and checked, so they are never cached
+#define BVH_CACHE_MIN_PRIMS 4096
+// After each save, the oldest files are deleted until the directory holds no more than this
+#define BVH_CACHE_MAX_BYTES ((size_t) 256 << 20)
+// Bump whenever the layout of the cached data changes
+#define BVH_CACHE_VERSION 1
+
+#if defined(BVH_SPATIAL_SPLITS) && BVH_SPLIT_METHOD != BVH_SPLIT_SAH
+    #error "BVH_SPATIAL_SPLITS requires BVH_SPLIT_SAH"
+#endif
+
+#define BVH_LEAF_FLAG 0x80000000u
+
+// Interior nodes store the index of their left child in offset, with the right child right after it,
+// and the axis they were split along in info. Leaves have BVH_LEAF_FLAG set in info, the primitive
+// count in its remaining bits, and offset pointing at their first entry in prim_indices
+typedef struct bvh_node
+{
+    aabb_t aabb;
+    uint32_t offset;
+    uint32_t info;
+} bvh_node_t;
+
+#if BVH_WIDTH == 4
+#define BVH4_STACK_SIZE 256
+
+// Child boxes are stored as bounds[min or max][axis][lane] so that one plane of all four children can
+// be loaded as a vector. counts is 0 for interior children, whose index is in children, and the
+// primitive count for leaf children, whose children entry is the offset into prim_indices. Unused
+// lanes hold a box at infinity that is never hit
+typedef struct bvh4_node
+{
+    _Alignas(16) float bounds[2][3][4];
+    uint32_t children[4];
+    uint32_t counts[4];
+} bvh4_node_t;
+#endif
+
+// Per-ray terms of the slab test, computed once before traversal so that each box test is a
+// multiply-subtract per plane with no divisions or min/max on the slab ends
+typedef struct bvh_ray
+{
+    vec3_t inv_dir;
+    vec3_t origin_inv_dir;
+    int dir_is_neg[3];
+} bvh_ray_t;
+
+typedef struct bvh
+{
+    bvh_node_t* nodes;
+    size_t num_nodes;
+    uint32_t* prim_indices;
+    // Greater than num_prims when spatial splits put primitives in several leaves
+    size_t num_prim_indices;
+    size_t num_prims;
+#if BVH_WIDTH == 4
+    bvh4_node_t* bvh4_nodes;
+    size_t num_bvh4_nodes;
+#endif
+    float build_sah_cost;
+    // Set when the arrays above point into a memory-mapped cache file rather than separate allocations
+    void* mapping;
+    size_t mapping_size;
+#ifdef BVH_SPATIAL_SPLITS
+    size_t num_spatial_splits;
+    // Child overlap, as in bvh_overlap, that the spatial splits removed compared to the best object
+    // splits at the same nodes
+    float spatial_overlap_removed;
+#endif
+} bvh_t;
+
+static inline bool bvh_node_is_leaf(const bvh_node_t* node)
+{
+    return node->info & BVH_LEAF_FLAG;
+}
+
+static inline uint32_t bvh_node_count(const bvh_node_t* node)
+{
+    return node->info & ~BVH_LEAF_FLAG;
+}
+
+static inline enum axis bvh_node_axis(const bvh_node_t* node)
+{
+    return (enum axis) node->info;
+}
+
+// Direction components smaller than this are raised to it, keeping their sign, before taking the
+// reciprocal. An exact or denormal zero would otherwise give an infinite inv_dir, and the slab test's
+// bound * inv_dir - origin * inv_dir would become inf - inf = NaN for every box
+#define BVH_RAY_MIN_DIR 1e-20f
+
+static inline void bvh_ray_init(const vec3_t origin, const vec3_t dir, bvh_ray_t* out)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float d = fabsf(dir[axis]) < BVH_RAY_MIN_DIR ? copysignf(BVH_RAY_MIN_DIR, dir[axis]) : dir[axis];
+        out->inv_dir[axis] = 1.0f / d;
+    }
+    vec3_element_mult(origin, out->inv_dir, out->origin_inv_dir);
+    out->dir_is_neg[0] = out->inv_dir[0] < 0.0f;
+    out->dir_is_neg[1] = out->inv_dir[1] < 0.0f;
+    out->dir_is_neg[2] = out->inv_dir[2] < 0.0f;
+}
+
+static inline bool bvh_ray_intersect_aabb(const bvh_ray_t* ray, const aabb_t* aabb, float tmin, float tmax)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float near = ray->dir_is_neg[axis] ? aabb->max[axis] : aabb->min[axis];
+        const float far = ray->dir_is_neg[axis] ? aabb->min[axis] : aabb->max[axis];
+        tmin = fmaxf(tmin, near * ray->inv_dir[axis] - ray->origin_inv_dir[axis]);
+        tmax = fminf(tmax, far * ray->inv_dir[axis] - ray->origin_inv_dir[axis]);
+    }
+    return tmin <= tmax;
+}
+
+void bvh_init(bvh_t* self);
+
+// Builds the tree over num_prims primitives with the given bounds, replacing any previous tree.
+// Large inputs are built on multiple threads
+void bvh_build(bvh_t* self, const aabb_t* prim_aabbs, size_t num_prims);
+
+// Expected cost of a ray query under the surface area heuristic, in units of the costs above
+float bvh_sah_cost(const bvh_t* self);
+
+// Total surface area shared by sibling boxes relative to the root's. Rays entering the shared volume
+// have to visit both siblings
+float bvh_overlap(const bvh_t* self);
+
+// Recomputes node bounds bottom-up for new primitive bounds while keeping the tree's topology, in
+// linear time. prim_aabbs must describe the same primitives the tree was built over. Returns the
+// resulting SAH cost, which can be compared against build_sah_cost to decide when to rebuild
+float bvh_refit(bvh_t* self, const aabb_t* prim_aabbs);
+
+void bvh_destroy(bvh_t* self);
+
+// Identifies the tree bvh_build would produce: a hash of the primitive bounds and every build setting
+uint64_t bvh_cache_key(const aabb_t* prim_aabbs, size_t num_prims);
+
+// Writes the tree to path, tagged with key. The file is written under a temporary name and renamed
+// into place, so concurrent runs never see a partial file
+bool bvh_save(const bvh_t* self, const char* path, uint64_t key);
+
+// Replaces the tree with one saved under key, mapped straight from the file without parsing or
+// copying. The mapping is private, so refits stay in memory. Fails, leaving the tree empty, if the file
+// is missing, was saved under another key, version or layout, or holds indices outside the tree or
+// outside num_prims
+bool bvh_load(bvh_t* self, const char* path, uint64_t key, size_t num_prims);
+
+// Deletes the least recently written tree files in dir until the rest take up at most max_bytes
+void bvh_cache_trim(const char* dir, size_t max_bytes);
+
+#endif
@@ -50,11 +50,11 @@ void camera_view_to_world(const camera_t* self, const vec3_t v, vec3_t out)
     vec3_add(out, scratch, out);
 }
 
-void camera_random_in_defocus_disk_world_space(const camera_t* self, vec3_t out)
+void camera_sample_defocus_disk(const camera_t* self, const float u[2], vec3_t out)
 {
     vec3_t unit_in_disk;
-    const float theta = rand_float_in_range(0, 2 * PI);
-    const float r = self->defocus_radius * sqrtf(rand_unit_float());
+    const float theta = 2.0f * PI * u[0];
+    const float r = self->defocus_radius * sqrtf(u[1]);
     const float x = r * cosf(theta);
     const float y = r * sinf(theta);
     vec3_t right;
@@ -25,6 +25,7 @@ void camera_world_to_view(const camera_t* self, const vec3_t v, vec3_t out);
 
 void camera_view_to_world(const camera_t* self, const vec3_t v, vec3_t out);
 
-void camera_random_in_defocus_disk_world_space(const camera_t* self, vec3_t out);
+// The point on the defocus disk, in world space, that two uniform numbers in [0, 1) map to
+void camera_sample_defocus_disk(const camera_t* self, const float u[2], vec3_t out);
 
 #endif
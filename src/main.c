@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "common.h"
 #include "pcg_basic.h"
@@ -8,6 +9,14 @@
 #include "renderer.h"
 #include "vector.h"
 
+// Samples each pixel gains per progressive pass, after which img.bmp shows the image so far
+#define PASS_SAMPLES 16
+// Least time between checkpoints, so that large images do not spend their time writing them
+#define CHECKPOINT_INTERVAL_SECONDS 60.0
+#define CHECKPOINT_PATH "img.ckpt"
+// Seeds the scene generators and the render, so that runs of the same build give the same image
+#define SEED 80
+
 #define TIME(fmt, ...) \
 clock_gettime(CLOCK_MONOTONIC, &begin); \
 do __VA_ARGS__ while(0); \
@@ -15,29 +24,117 @@ clock_gettime(CLOCK_MONOTONIC, &end); \
 elapsed = (double)(end.tv_sec - begin.tv_sec) + (double)(end.tv_nsec - begin.tv_nsec) / 1e9; \
 printf(fmt, elapsed) \
 
-int main()
+static double seconds_since(const struct timespec* begin)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - begin->tv_sec) + (double)(now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+// Renders the Cornell box, or the mesh in the OBJ file given as the first argument, in passes of
+// PASS_SAMPLES samples. The samples so far are saved to CHECKPOINT_PATH as it goes, and a later run of the
+// same scene resumes from there, so an interrupted render loses at most CHECKPOINT_INTERVAL_SECONDS
+int main(int argc, char** argv)
 {
     struct timespec begin, end;
     double elapsed;
-    pcg32_srandom(80, time(NULL));
+    pcg32_srandom(SEED, 0);
 
     scene_t scene;
+    bool loaded = true;
     TIME("Scene initialized in %f seconds\n", {
-        scene_cornell_box_init(&scene);
+        if (argc > 1)
+        {
+            loaded = scene_mesh_init(&scene, argv[1]);
+        }
+        else
+        {
+            scene_cornell_box_init(&scene);
+        }
     });
+    if (!loaded)
+    {
+        fprintf(stderr, "Failed to load %s\n", argv[1]);
+        return -1;
+    }
+    TIME("BVH built in %f seconds\n", {
+        scene_build_bvh(&scene);
+    });
+    printf("BVH SAH cost: %f\n", scene_bvh_sah_cost(&scene));
+    printf("BVH child overlap: %f\n", scene_bvh_overlap(&scene));
+#ifdef BVH_SPATIAL_SPLITS
+    size_t num_splits, num_refs;
+    float overlap_removed;
+    scene_bvh_spatial_split_stats(&scene, &num_splits, &num_refs, &overlap_removed);
+    printf("BVH spatial splits: %zu, %zu references for %zu objects, child overlap reduced by %f\n",
+        num_splits, num_refs, scene.num_objects, overlap_removed);
+#endif
 
+    render_settings_t settings;
+    render_settings_default(&settings);
+    settings.seed = SEED;
     vec3_t* pixels = malloc(PIXEL_WIDTH * PIXEL_HEIGHT * sizeof(vec3_t));
-    
+    uint32_t* sample_counts = malloc(PIXEL_WIDTH * PIXEL_HEIGHT * sizeof(uint32_t));
+
+    // A checkpoint is only resumed by a render of the same scene with settings that take the same samples
+    const char* scene_name = argc > 1 ? argv[1] : "cornell";
+    const uint64_t size[] = {PIXEL_WIDTH, PIXEL_HEIGHT};
+    uint64_t key = hash_bytes(scene_name, strlen(scene_name), HASH_SEED);
+    key = hash_bytes(size, sizeof(size), key);
+    key = scene_hash(&scene, key);
+    key = render_settings_hash(&settings, key);
+    render_accumulator_t accumulator;
+    render_accumulator_init(&accumulator, PIXEL_WIDTH, PIXEL_HEIGHT, key);
+    if (render_accumulator_load(&accumulator, CHECKPOINT_PATH))
+    {
+        printf("Resuming from %s\n", CHECKPOINT_PATH);
+    }
+
+    int success = 0;
     TIME("Scene rendered in %f seconds\n", {
-        render(&scene, pixels, PIXEL_WIDTH, PIXEL_HEIGHT);
+        struct timespec last_checkpoint;
+        clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+        for (size_t target = render_next_target(&settings, &accumulator, 0, PASS_SAMPLES); target > 0; )
+        {
+            render_pass(&scene, &settings, &accumulator, target);
+            target = render_next_target(&settings, &accumulator, target, PASS_SAMPLES);
+            const bool last_pass = target == 0;
+            render_accumulator_resolve(&accumulator, pixels, sample_counts);
+            if (!write_pixels_to_bmp(pixels, PIXEL_WIDTH, PIXEL_HEIGHT, "img.bmp"))
+            {
+                fprintf(stderr, "Failed to write pixels");
+                success = -1;
+                break;
+            }
+            if (last_pass || seconds_since(&last_checkpoint) >= CHECKPOINT_INTERVAL_SECONDS)
+            {
+                if (!render_accumulator_save(&accumulator, CHECKPOINT_PATH))
+                {
+                    fprintf(stderr, "Failed to write checkpoint");
+                }
+                clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+            }
+        }
     });
+    render_accumulator_destroy(&accumulator);
+    uint64_t total_samples = 0;
+    for (size_t i = 0; i < PIXEL_WIDTH * PIXEL_HEIGHT; i++)
+    {
+        total_samples += sample_counts[i];
+    }
+    printf("Samples per pixel: %f\n", (double) total_samples / (PIXEL_WIDTH * PIXEL_HEIGHT));
+#ifdef BVH_STATS
+    uint64_t rays, nodes_visited;
+    scene_bvh_stats(&rays, &nodes_visited);
+    printf("BVH nodes visited per ray: %f\n", (double) nodes_visited / rays);
+#endif
 
-    int success = 0;
-    if (!write_pixels_to_bmp(pixels, PIXEL_WIDTH, PIXEL_HEIGHT, "img.bmp"))
+    if (!write_counts_to_bmp(sample_counts, PIXEL_WIDTH, PIXEL_HEIGHT, "samples.bmp"))
     {
-        fprintf(stderr, "Failed to write pixels");
+        fprintf(stderr, "Failed to write sample counts");
         success = -1;
     }
+    free(sample_counts);
     free(pixels);
     scene_destroy(&scene);
 
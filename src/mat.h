@@ -0,0 +1,103 @@
+#ifndef MAT_H
+#define MAT_H
+
+#include "vec.h"
+
+// Affine transform stored as the top three rows of a 4x4 matrix. Column 3 is the translation
+typedef struct mat34
+{
+    float m[3][4];
+} mat34_t;
+
+static inline void mat34_identity(mat34_t* out)
+{
+    memset(out, 0, sizeof(mat34_t));
+    out->m[0][0] = 1.0f;
+    out->m[1][1] = 1.0f;
+    out->m[2][2] = 1.0f;
+}
+
+static inline void mat34_translation(const vec3_t offset, mat34_t* out)
+{
+    mat34_identity(out);
+    out->m[0][3] = offset[0];
+    out->m[1][3] = offset[1];
+    out->m[2][3] = offset[2];
+}
+
+// Maps the unit x, y and z axes to the given vectors and the origin to origin
+static inline void mat34_from_axes(const vec3_t x, const vec3_t y, const vec3_t z, const vec3_t origin, mat34_t* out)
+{
+    for (int row = 0; row < 3; row++)
+    {
+        out->m[row][0] = x[row];
+        out->m[row][1] = y[row];
+        out->m[row][2] = z[row];
+        out->m[row][3] = origin[row];
+    }
+}
+
+static inline void mat34_transform_point(const mat34_t* self, const vec3_t p, vec3_t out)
+{
+    vec3_t result;
+    for (int row = 0; row < 3; row++)
+    {
+        result[row] = self->m[row][0] * p[0] + self->m[row][1] * p[1] + self->m[row][2] * p[2] + self->m[row][3];
+    }
+    vec3_copy(result, out);
+}
+
+static inline void mat34_transform_dir(const mat34_t* self, const vec3_t d, vec3_t out)
+{
+    vec3_t result;
+    for (int row = 0; row < 3; row++)
+    {
+        result[row] = self->m[row][0] * d[0] + self->m[row][1] * d[1] + self->m[row][2] * d[2];
+    }
+    vec3_copy(result, out);
+}
+
+// Multiplies by the transpose of the linear part. Given the inverse of a transform, this maps normals
+// through the transform itself
+static inline void mat34_transpose_transform_dir(const mat34_t* self, const vec3_t d, vec3_t out)
+{
+    vec3_t result;
+    for (int col = 0; col < 3; col++)
+    {
+        result[col] = self->m[0][col] * d[0] + self->m[1][col] * d[1] + self->m[2][col] * d[2];
+    }
+    vec3_copy(result, out);
+}
+
+static inline bool mat34_inverse(const mat34_t* self, mat34_t* out)
+{
+    const float (*m)[4] = self->m;
+    const float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    const float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    const float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    const float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    // Scaled transforms have determinants far from 1 either way, so only an exact zero is rejected
+    if (det == 0.0f) return false;
+    const float inv_det = 1.0f / det;
+
+    mat34_t result;
+    result.m[0][0] = c00 * inv_det;
+    result.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    result.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    result.m[1][0] = c01 * inv_det;
+    result.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    result.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    result.m[2][0] = c02 * inv_det;
+    result.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    result.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    const vec3_t translation = {m[0][3], m[1][3], m[2][3]};
+    for (int row = 0; row < 3; row++)
+    {
+        result.m[row][3] = -(result.m[row][0] * translation[0] + result.m[row][1] * translation[1] + result.m[row][2] * translation[2]);
+    }
+    memcpy(out, &result, sizeof(mat34_t));
+    return true;
+}
+
+#endif
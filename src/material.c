@@ -3,6 +3,7 @@
 #include <assert.h>
 #include "ray.h"
 #include "texture.h"
+#include "utils.h"
 
 // Honestly no clue what this does, but thanks "Ray Tracing in One Weekend"
 static float reflectance(float cos_theta, float refraction_index)
@@ -12,51 +13,203 @@ static float reflectance(float cos_theta, float refraction_index)
     return r0 + (1.0f - r0) * powf(1.0f - cos_theta, 5.0f);
 }
 
-static bool material_lambertian_scatter(const ray_t* ray, const ray_hit_t* hit, ray_t* out_ray, vec3_t out_attenuation)
+// Transforms a world space direction into the basis with the normal as its third axis, and back
+static void to_local(const vec3_t t, const vec3_t b, const vec3_t n, const vec3_t v, vec3_t out)
 {
-    vec3_t random_unit;
-    vec3_random_unit(random_unit);
-    vec3_add(hit->normal, random_unit, out_ray->dir);
-    if (unlikely(vec3_is_near_zero(out_ray->dir)))
+    vec3_set(out, vec3_dot(v, t), vec3_dot(v, b), vec3_dot(v, n));
+}
+
+static void to_world(const vec3_t t, const vec3_t b, const vec3_t n, const vec3_t v, vec3_t out)
+{
+    for (int i = 0; i < 3; i++)
     {
-        vec3_copy(hit->normal, out_ray->dir);
+        out[i] = t[i] * v[0] + b[i] * v[1] + n[i] * v[2];
     }
-    vec3_normalize(out_ray->dir, out_ray->dir);
-    vec3_copy(hit->position, out_ray->begin);
-    texture_sample(hit->material->underlying.lambertian.tex, 0, 0, hit->position, out_attenuation);
+}
+
+// Picks a direction with probability proportional to its cosine with the normal, by mapping the unit
+// square onto the unit disk and projecting up to the hemisphere
+static bool material_lambertian_sample(const ray_hit_t* hit, const float u[3], bsdf_sample_t* out)
+{
+    const float r = sqrtf(u[0]);
+    const float phi = 2.0f * PI * u[1];
+    const float cos_theta = sqrtf(fmaxf(0.0f, 1.0f - u[0]));
+    if (cos_theta <= 0.0f) return false;
+
+    vec3_t t, b;
+    vec3_orthonormal_basis(hit->normal, t, b);
+    to_world(t, b, hit->normal, (vec3_t){r * cosf(phi), r * sinf(phi), cos_theta}, out->dir);
+    texture_sample(hit->material->underlying.lambertian.tex, 0, 0, hit->position, out->bsdf);
+    vec3_mult(out->bsdf, 1.0f / PI, out->bsdf);
+    out->pdf = cos_theta / PI;
+    out->lobe = BSDF_DIFFUSE;
     return true;
 }
 
-static bool material_metal_scatter(const ray_t* ray, const ray_hit_t* hit, ray_t* out_ray, vec3_t out_attenuation)
+static bool material_lambertian_eval(const ray_hit_t* hit, const vec3_t dir, vec3_t out_bsdf, float* out_pdf)
+{
+    const float cos_theta = vec3_dot(hit->normal, dir);
+    if (cos_theta <= 0.0f)
+    {
+        vec3_zero(out_bsdf);
+        *out_pdf = 0.0f;
+        return true;
+    }
+    texture_sample(hit->material->underlying.lambertian.tex, 0, 0, hit->position, out_bsdf);
+    vec3_mult(out_bsdf, 1.0f / PI, out_bsdf);
+    *out_pdf = cos_theta / PI;
+    return true;
+}
+
+// Schlick's approximation to the Fresnel reflectance of a conductor that reflects f0 head on
+static void fresnel_schlick(const vec3_t f0, float cos_theta, vec3_t out)
+{
+    const float k = powf(1.0f - fmaxf(0.0f, cos_theta), 5.0f);
+    for (int i = 0; i < 3; i++)
+    {
+        out[i] = f0[i] + (1.0f - f0[i]) * k;
+    }
+}
+
+// GGX distribution of microfacet normals m, in the local basis
+static float ggx_d(float alpha, const vec3_t m)
+{
+    const float alpha_sq = alpha * alpha;
+    const float k = m[2] * m[2] * (alpha_sq - 1.0f) + 1.0f;
+    return alpha_sq / (PI * k * k);
+}
+
+// Smith masking of microfacets seen from direction w, in the local basis
+static float ggx_g1(float alpha, const vec3_t w)
+{
+    const float tan_sq = (w[0] * w[0] + w[1] * w[1]) / (w[2] * w[2]);
+    return 2.0f / (1.0f + sqrtf(1.0f + alpha * alpha * tan_sq));
+}
+
+// Reflection off GGX microfacets from wi to wo, both pointing away from the surface in the local basis,
+// with the pdf of ggx_sample_visible_normal then reflecting wi picking wo
+static void metal_ggx_eval(const struct metal* metal, float alpha, const vec3_t wi, const vec3_t wo, vec3_t out_bsdf, float* out_pdf)
+{
+    if (wi[2] <= 0.0f || wo[2] <= 0.0f)
+    {
+        vec3_zero(out_bsdf);
+        *out_pdf = 0.0f;
+        return;
+    }
+    vec3_t h;
+    vec3_add(wi, wo, h);
+    vec3_normalize(h, h);
+    const float d = ggx_d(alpha, h);
+    const float g1_wi = ggx_g1(alpha, wi);
+    fresnel_schlick(metal->albedo, vec3_dot(wi, h), out_bsdf);
+    vec3_mult(out_bsdf, d * g1_wi * ggx_g1(alpha, wo) / (4.0f * wi[2] * wo[2]), out_bsdf);
+    *out_pdf = g1_wi * d / (4.0f * wi[2]);
+}
+
+// A microfacet normal seen from wi, with the density of normals wi actually sees, so that no samples are
+// spent on facets facing away from it (Heitz, "Sampling the GGX Distribution of Visible Normals")
+static void ggx_sample_visible_normal(float alpha, const vec3_t wi, const float u[2], vec3_t out)
 {
-    vec3_reflect(ray->dir, hit->normal, out_ray->dir);
-    vec3_t random_offset;
-    vec3_random_unit(random_offset);
-    vec3_mult(random_offset, hit->material->underlying.metal.fuzz, random_offset);
-    vec3_add(out_ray->dir, random_offset, out_ray->dir);
-    vec3_normalize(out_ray->dir, out_ray->dir);
+    vec3_t v = {alpha * wi[0], alpha * wi[1], wi[2]};
+    vec3_normalize(v, v);
 
-    vec3_copy(hit->position, out_ray->begin);
-    vec3_copy(hit->material->underlying.metal.albedo, out_attenuation);
-    return (vec3_dot(out_ray->dir, hit->normal) > 0.0f);
+    const float len_sq = v[0] * v[0] + v[1] * v[1];
+    vec3_t t1, t2;
+    if (len_sq > 0.0f)
+    {
+        const float inv_len = 1.0f / sqrtf(len_sq);
+        vec3_set(t1, -v[1] * inv_len, v[0] * inv_len, 0.0f);
+    }
+    else
+    {
+        vec3_set(t1, 1.0f, 0.0f, 0.0f);
+    }
+    vec3_cross(v, t1, t2);
+
+    const float r = sqrtf(u[0]);
+    const float phi = 2.0f * PI * u[1];
+    const float p1 = r * cosf(phi);
+    const float s = 0.5f * (1.0f + v[2]);
+    const float p2 = (1.0f - s) * sqrtf(1.0f - p1 * p1) + s * r * sinf(phi);
+    const float p3 = sqrtf(fmaxf(0.0f, 1.0f - p1 * p1 - p2 * p2));
+
+    vec3_t m;
+    for (int i = 0; i < 3; i++)
+    {
+        m[i] = p1 * t1[i] + p2 * t2[i] + p3 * v[i];
+    }
+    vec3_set(out, alpha * m[0], alpha * m[1], fmaxf(0.0f, m[2]));
+    vec3_normalize(out, out);
 }
 
-static bool material_dielectric_scatter(const ray_t* ray, const ray_hit_t* hit, ray_t* out_ray, vec3_t out_attenuation)
+static bool material_metal_sample(const ray_t* ray, const ray_hit_t* hit, const float u[3], bsdf_sample_t* out)
+{
+    const struct metal* metal = &hit->material->underlying.metal;
+    vec3_t wi_world;
+    vec3_negate(ray->dir, wi_world);
+    if (metal->fuzz < METAL_MIN_FUZZ)
+    {
+        vec3_reflect(ray->dir, hit->normal, out->dir);
+        fresnel_schlick(metal->albedo, vec3_dot(wi_world, hit->normal), out->bsdf);
+        out->pdf = 1.0f;
+        out->lobe = BSDF_SPECULAR_REFLECTION;
+        return true;
+    }
+
+    const float alpha = metal->fuzz * metal->fuzz;
+    vec3_t t, b, wi, m, wo;
+    vec3_orthonormal_basis(hit->normal, t, b);
+    to_local(t, b, hit->normal, wi_world, wi);
+    if (wi[2] <= 0.0f) return false;
+
+    ggx_sample_visible_normal(alpha, wi, u, m);
+    vec3_mult(m, 2.0f * vec3_dot(wi, m), wo);
+    vec3_sub(wo, wi, wo);
+    if (wo[2] <= 0.0f) return false;
+
+    metal_ggx_eval(metal, alpha, wi, wo, out->bsdf, &out->pdf);
+    if (out->pdf <= 0.0f) return false;
+    to_world(t, b, hit->normal, wo, out->dir);
+    out->lobe = BSDF_GLOSSY;
+    return true;
+}
+
+static bool material_metal_eval(const ray_t* ray, const ray_hit_t* hit, const vec3_t dir, vec3_t out_bsdf, float* out_pdf)
+{
+    const struct metal* metal = &hit->material->underlying.metal;
+    if (metal->fuzz < METAL_MIN_FUZZ) return false;
+
+    vec3_t t, b, wi_world, wi, wo;
+    vec3_orthonormal_basis(hit->normal, t, b);
+    vec3_negate(ray->dir, wi_world);
+    to_local(t, b, hit->normal, wi_world, wi);
+    to_local(t, b, hit->normal, dir, wo);
+    metal_ggx_eval(metal, metal->fuzz * metal->fuzz, wi, wo, out_bsdf, out_pdf);
+    return true;
+}
+
+// Reflects with the Fresnel reflectance's probability and refracts otherwise, so the weight of either
+// choice is one
+static bool material_dielectric_sample(const ray_t* ray, const ray_hit_t* hit, const float u[3], bsdf_sample_t* out)
 {
     const float refraction_index = hit->material->underlying.dielectric.refraction_index;
-    vec3_copy((vec3_t){1.0f, 1.0f, 1.0f}, out_attenuation);
     const float eta = hit->front_face ? 1.0f / refraction_index : refraction_index;
-    const float cos_theta = -vec3_dot(hit->normal, ray->dir);
+    const float cos_theta = fminf(-vec3_dot(hit->normal, ray->dir), 1.0f);
     const float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
-    if (eta * sin_theta > 1.0f || reflectance(cos_theta, refraction_index) > rand_unit_float())
+    const float reflect_probability = eta * sin_theta > 1.0f ? 1.0f : reflectance(cos_theta, refraction_index);
+    if (u[2] < reflect_probability)
     {
-        vec3_reflect(ray->dir, hit->normal, out_ray->dir);
+        vec3_reflect(ray->dir, hit->normal, out->dir);
+        out->pdf = reflect_probability;
+        out->lobe = BSDF_SPECULAR_REFLECTION;
     }
     else
     {
-        vec3_refract(ray->dir, hit->normal, eta, out_ray->dir);
+        vec3_refract(ray->dir, hit->normal, eta, out->dir);
+        out->pdf = 1.0f - reflect_probability;
+        out->lobe = BSDF_SPECULAR_TRANSMISSION;
     }
-    vec3_copy(hit->position, out_ray->begin);
+    vec3_fill(out->bsdf, out->pdf);
     return true;
 }
 
@@ -140,16 +293,16 @@ material_t* material_acquire(material_t* mat)
     return mat;
 }
 
-bool material_scatter(const material_t* self, const ray_t* ray, const ray_hit_t* hit, ray_t* out_ray, vec3_t out_attenuation)
+bool material_sample(const material_t* self, const ray_t* ray, const ray_hit_t* hit, const float u[3], bsdf_sample_t* out)
 {
     switch (self->type)
     {
         case MATERIAL_LAMBERTIAN:
-            return material_lambertian_scatter(ray, hit, out_ray, out_attenuation);
+            return material_lambertian_sample(hit, u, out);
         case MATERIAL_METAL:
-            return material_metal_scatter(ray, hit, out_ray, out_attenuation);
+            return material_metal_sample(ray, hit, u, out);
         case MATERIAL_DIELECTRIC:
-            return material_dielectric_scatter(ray, hit, out_ray, out_attenuation);
+            return material_dielectric_sample(ray, hit, u, out);
         case MATERIAL_POINT_LIGHT:
             return false;
         default:
@@ -158,6 +311,19 @@ bool material_scatter(const material_t* self, const ray_t* ray, const ray_hit_t*
     }
 }
 
+bool material_eval(const material_t* self, const ray_t* ray, const ray_hit_t* hit, const vec3_t dir, vec3_t out_bsdf, float* out_pdf)
+{
+    switch (self->type)
+    {
+        case MATERIAL_LAMBERTIAN:
+            return material_lambertian_eval(hit, dir, out_bsdf, out_pdf);
+        case MATERIAL_METAL:
+            return material_metal_eval(ray, hit, dir, out_bsdf, out_pdf);
+        default:
+            return false;
+    }
+}
+
 bool material_emit(const material_t* self, vec3_t out_color)
 {
     switch (self->type)
@@ -168,4 +334,24 @@ bool material_emit(const material_t* self, vec3_t out_color)
             vec3_zero(out_color);
             return false;
     }
-}
\ No newline at end of file
+}
+
+uint64_t material_hash(const material_t* self, uint64_t hash)
+{
+    hash = hash_bytes(&self->type, sizeof(self->type), hash);
+    switch (self->type)
+    {
+        case MATERIAL_LAMBERTIAN:
+            return texture_hash(self->underlying.lambertian.tex, hash);
+        case MATERIAL_METAL:
+            hash = hash_bytes(self->underlying.metal.albedo, sizeof(vec3_t), hash);
+            return hash_bytes(&self->underlying.metal.fuzz, sizeof(float), hash);
+        case MATERIAL_DIELECTRIC:
+            return hash_bytes(&self->underlying.dielectric.refraction_index, sizeof(float), hash);
+        case MATERIAL_POINT_LIGHT:
+            return hash_bytes(self->underlying.point_light.color, sizeof(vec3_t), hash);
+        default:
+            assert(false);
+            return hash;
+    }
+}
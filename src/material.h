@@ -24,6 +24,8 @@ struct lambertian
     texture_t* tex;
 };
 
+// GGX microfacets with roughness fuzz squared, reflecting albedo at normal incidence. Below
+// METAL_MIN_FUZZ the metal is a perfect mirror
 struct metal
 {
     vec3_t albedo;
@@ -40,6 +42,34 @@ struct point_light
     vec3_t color;
 };
 
+#define METAL_MIN_FUZZ 0.03f
+
+// How a scattered direction was chosen
+enum bsdf_lobe
+{
+    BSDF_DIFFUSE,
+    BSDF_GLOSSY,
+    BSDF_SPECULAR_REFLECTION,
+    BSDF_SPECULAR_TRANSMISSION
+};
+
+// A direction picked by material_sample. For specular lobes, which scatter into a single direction, pdf is
+// the probability of having picked that lobe and bsdf already includes the cosine, so the path's
+// throughput is scaled by bsdf / pdf. Otherwise pdf is per unit solid angle and the throughput is scaled
+// by bsdf * cos / pdf
+typedef struct bsdf_sample
+{
+    vec3_t dir;
+    vec3_t bsdf;
+    float pdf;
+    enum bsdf_lobe lobe;
+} bsdf_sample_t;
+
+static inline bool bsdf_lobe_is_specular(enum bsdf_lobe lobe)
+{
+    return lobe == BSDF_SPECULAR_REFLECTION || lobe == BSDF_SPECULAR_TRANSMISSION;
+}
+
 typedef struct material
 {
     union 
@@ -67,8 +97,19 @@ void material_release(material_t* self);
 
 material_t* material_acquire(material_t* other);
 
-bool material_scatter(const material_t* self, const ray_t* ray, const ray_hit_t* hit, ray_t* out_ray, vec3_t out_attenutation);
+// Picks a direction for light to arrive from at the hit, given three uniform numbers in [0, 1): two for
+// the direction and one for the choice between lobes. Returns false if the path is absorbed
+bool material_sample(const material_t* self, const ray_t* ray, const ray_hit_t* hit, const float u[3], bsdf_sample_t* out);
 
 bool material_emit(const material_t* self, vec3_t out_color);
 
+// The BSDF for light arriving from dir and leaving back along ray, and the pdf of material_sample picking
+// dir. Returns false for materials that only scatter into single directions, which light sampling cannot
+// help
+bool material_eval(const material_t* self, const ray_t* ray, const ray_hit_t* hit, const vec3_t dir, vec3_t out_bsdf, float* out_pdf);
+
+// Continues hash, as from hash_bytes, over the material's type and parameters, so that equal materials
+// hash alike from run to run
+uint64_t material_hash(const material_t* self, uint64_t hash);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include "mesh.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include "vec.h"
+
+#define OBJ_READ_BUFFER_SIZE (1 << 16)
+
+// Vertex and index buffers grown as the file is parsed. They become the mesh's buffers when parsing ends
+struct obj_parser
+{
+    vec3_t* vertices;
+    size_t num_vertices;
+    size_t vertex_capacity;
+    uint32_t* indices;
+    size_t num_indices;
+    size_t index_capacity;
+};
+
+static mesh_t* mesh_wrap(vec3_t* vertices, size_t num_vertices, uint32_t* indices, size_t num_triangles)
+{
+    mesh_t* ret = malloc(sizeof(mesh_t));
+    ret->vertices = vertices;
+    ret->num_vertices = num_vertices;
+    ret->indices = indices;
+    ret->num_triangles = num_triangles;
+    ret->ref_count = 1;
+    return ret;
+}
+
+mesh_t* mesh_new(const vec3_t* vertices, size_t num_vertices, const uint32_t* indices, size_t num_triangles)
+{
+    vec3_t* vertices_copy = malloc(sizeof(vec3_t) * num_vertices);
+    uint32_t* indices_copy = malloc(sizeof(uint32_t) * 3 * num_triangles);
+    memcpy(vertices_copy, vertices, sizeof(vec3_t) * num_vertices);
+    memcpy(indices_copy, indices, sizeof(uint32_t) * 3 * num_triangles);
+    for (size_t i = 0; i < 3 * num_triangles; i++)
+    {
+        assert(indices[i] < num_vertices);
+    }
+    return mesh_wrap(vertices_copy, num_vertices, indices_copy, num_triangles);
+}
+
+static bool obj_push_vertex(struct obj_parser* parser, const vec3_t v)
+{
+    if (parser->num_vertices == parser->vertex_capacity)
+    {
+        const size_t capacity = parser->vertex_capacity ? parser->vertex_capacity * 2 : 1024;
+        vec3_t* vertices = realloc(parser->vertices, sizeof(vec3_t) * capacity);
+        if (!vertices) return false;
+        parser->vertices = vertices;
+        parser->vertex_capacity = capacity;
+    }
+    vec3_copy(v, parser->vertices[parser->num_vertices++]);
+    return true;
+}
+
+static bool obj_push_triangle(struct obj_parser* parser, uint32_t i0, uint32_t i1, uint32_t i2)
+{
+    if (parser->num_indices + 3 > parser->index_capacity)
+    {
+        const size_t capacity = parser->index_capacity ? parser->index_capacity * 2 : 3 * 1024;
+        uint32_t* indices = realloc(parser->indices, sizeof(uint32_t) * capacity);
+        if (!indices) return false;
+        parser->indices = indices;
+        parser->index_capacity = capacity;
+    }
+    parser->indices[parser->num_indices++] = i0;
+    parser->indices[parser->num_indices++] = i1;
+    parser->indices[parser->num_indices++] = i2;
+    return true;
+}
+
+// "v x y z [w]"
+static bool obj_parse_vertex(struct obj_parser* parser, const char* c)
+{
+    vec3_t v;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        char* end;
+        v[axis] = strtof(c, &end);
+        if (end == c) return false;
+        c = end;
+    }
+    return parser->num_vertices < UINT32_MAX && obj_push_vertex(parser, v);
+}
+
+// "f v1[/vt1][/vn1] v2... v3..." with any number of vertices. Indices are 1-based, or relative to the
+// end of the vertex list when negative
+static bool obj_parse_face(struct obj_parser* parser, const char* c)
+{
+    uint32_t first = 0;
+    uint32_t prev = 0;
+    size_t count = 0;
+    while (true)
+    {
+        while (isspace((unsigned char) *c)) c++;
+        if (*c == '\0') break;
+
+        char* end;
+        const long index = strtol(c, &end, 10);
+        if (end == c) return false;
+        c = end;
+        while (*c != '\0' && !isspace((unsigned char) *c)) c++;
+
+        const long resolved = index < 0 ? (long) parser->num_vertices + index : index - 1;
+        if (index == 0 || resolved < 0 || (size_t) resolved >= parser->num_vertices) return false;
+
+        const uint32_t vertex = (uint32_t) resolved;
+        if (count == 0)
+        {
+            first = vertex;
+        }
+        else if (count >= 2 && !obj_push_triangle(parser, first, prev, vertex))
+        {
+            return false;
+        }
+        prev = vertex;
+        count++;
+    }
+    return count >= 3;
+}
+
+// Other statements, such as normals, texture coordinates, groups and materials, are skipped
+static bool obj_parse_line(struct obj_parser* parser, const char* line)
+{
+    while (isspace((unsigned char) *line)) line++;
+    if (line[0] == 'v' && isspace((unsigned char) line[1])) return obj_parse_vertex(parser, line + 1);
+    if (line[0] == 'f' && isspace((unsigned char) line[1])) return obj_parse_face(parser, line + 1);
+    return true;
+}
+
+mesh_t* mesh_load_obj(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    struct obj_parser parser = {0};
+    // One extra byte to terminate a final line that has no newline
+    char* buffer = malloc(OBJ_READ_BUFFER_SIZE + 1);
+    size_t len = 0;
+    bool success = true;
+    while (success)
+    {
+        const size_t num_read = fread(buffer + len, 1, OBJ_READ_BUFFER_SIZE - len, file);
+        len += num_read;
+
+        // Parse every complete line in place, then move the partial line at the end to the front
+        char* line = buffer;
+        char* const end = buffer + len;
+        char* newline;
+        while (success && (newline = memchr(line, '\n', end - line)))
+        {
+            *newline = '\0';
+            success = obj_parse_line(&parser, line);
+            line = newline + 1;
+        }
+        len = end - line;
+        memmove(buffer, line, len);
+
+        if (num_read == 0)
+        {
+            if (ferror(file)) success = false;
+            if (success && len > 0)
+            {
+                buffer[len] = '\0';
+                success = obj_parse_line(&parser, buffer);
+            }
+            break;
+        }
+        // A line that fills the whole buffer can never be completed
+        if (len == OBJ_READ_BUFFER_SIZE) success = false;
+    }
+    free(buffer);
+    fclose(file);
+
+    if (!success || parser.num_indices == 0)
+    {
+        free(parser.vertices);
+        free(parser.indices);
+        return NULL;
+    }
+    return mesh_wrap(parser.vertices, parser.num_vertices, parser.indices, parser.num_indices / 3);
+}
+
+void mesh_bounds(const mesh_t* self, aabb_t* out)
+{
+    aabb_empty(out);
+    for (size_t i = 0; i < self->num_vertices; i++)
+    {
+        aabb_grow(out, self->vertices[i]);
+    }
+}
+
+mesh_t* mesh_acquire(mesh_t* self)
+{
+    self->ref_count++;
+    return self;
+}
+
+void mesh_release(mesh_t* self)
+{
+    if (--self->ref_count > 0) return;
+    free(self->vertices);
+    free(self->indices);
+    free(self);
+}
@@ -0,0 +1,40 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "common.h"
+#include "aabb.h"
+
+// Triangles sharing one vertex buffer. Triangle i is made of the vertices at indices[3 * i] through
+// indices[3 * i + 2], wound counterclockwise when seen from its front. Reference counted like materials
+typedef struct mesh
+{
+    vec3_t* vertices;
+    size_t num_vertices;
+    uint32_t* indices;
+    size_t num_triangles;
+    int ref_count;
+} mesh_t;
+
+static inline void mesh_triangle_vertices(const mesh_t* self, size_t triangle, const float** out_v0, const float** out_v1, const float** out_v2)
+{
+    const uint32_t* indices = &self->indices[3 * triangle];
+    *out_v0 = self->vertices[indices[0]];
+    *out_v1 = self->vertices[indices[1]];
+    *out_v2 = self->vertices[indices[2]];
+}
+
+// Copies the given buffers
+mesh_t* mesh_new(const vec3_t* vertices, size_t num_vertices, const uint32_t* indices, size_t num_triangles);
+
+// Reads the vertex positions and faces of a Wavefront OBJ file, splitting polygons into triangle fans.
+// The file is streamed through a fixed buffer and parsed in place, so memory use is the mesh itself.
+// Returns NULL if the file cannot be read or is malformed
+mesh_t* mesh_load_obj(const char* path);
+
+void mesh_bounds(const mesh_t* self, aabb_t* out);
+
+mesh_t* mesh_acquire(mesh_t* self);
+
+void mesh_release(mesh_t* self);
+
+#endif
@@ -18,6 +18,8 @@ typedef struct ray_hit
     vec3_t position;
     vec3_t normal;
     const material_t* material;
+    // The primitive hit, inside an instance's geometry if it was hit through one
+    const scene_object_t* object;
     float t;
     bool front_face;
 } ray_hit_t;
@@ -1,16 +1,43 @@
 #include "renderer.h"
 
+#include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <time.h>
 #include "scene.h"
 #include "ray.h"
 #include "material.h"
+#include "utils.h"
 
 #define MAX_RAY_BOUNCES 10
+#define ROULETTE_MIN_BOUNCES 3
+// Paths always have some chance of ending once roulette starts, so bright paths between mirrors still end
+#define ROULETTE_MAX_SURVIVAL 0.95f
+// Shadow rays stop this fraction short of the point sampled on a light, so they do not hit the light itself
+#define SHADOW_RAY_END_MARGIN 1e-3f
 #define NUM_SAMPLES 400
+#define ADAPTIVE_ERROR 0.01f
+#define ADAPTIVE_MIN_SAMPLES 32
+// By default, a pixel that has not converged may take this many times the image's average samples
+#define ADAPTIVE_MAX_SAMPLES_FACTOR 4
+// Adaptive sampling only tests a pixel every this many samples, since stopping on the first sample whose
+// running variance happens to dip would bias toward smooth-looking estimates
+#define ADAPTIVE_CHECK_INTERVAL 16
+// Mean luminance below which the error is measured against this instead, so that black pixels, whose
+// relative error is undefined, still converge
+#define ADAPTIVE_MIN_LUMINANCE 0.05f
 #define GAMMA_EXPONENT 2.2f
 #define INV_GAMMA_EXPONENT (1.0f / 2.2f)
-#define NUM_THREADS 8
+// Side of the square tiles threads take from a shared counter. Small enough that threads which finish
+// their tiles early keep taking more wherever the expensive geometry is, and a multiple of
+// PRIMARY_PACKET_WIDTH so packets stay square
+#define RENDER_TILE_SIZE 16
+// Paths in flight per thread in wavefront mode
+#define WAVEFRONT_QUEUE_SIZE 4096
+// Side of the square blocks of pixels whose camera rays are traced as one packet, at most
+// sqrt(RAY_PACKET_SIZE)
+#define PRIMARY_PACKET_WIDTH 4
 
 static const vec3_t WHITE_COLOR = {1.0f, 1.0f, 1.0f};
 //static const vec3_t FILL_COLOR = {0.5f, 0.7f, 1.0f};
@@ -24,124 +51,1038 @@ static void linear_to_gamma(vec3_t color)
     color[2] = powf(color[2], INV_GAMMA_EXPONENT);
 }
 
-static void render_pixel(const struct scene* scene, const ray_t* ray, vec3_t pixel, int bounces)
+static void background_color(const vec3_t dir, vec3_t out)
 {
-    if (bounces >= MAX_RAY_BOUNCES)
+    float a = (dir[1] + 1.0f) / 2.0f;
+
+    vec3_copy(FILL_COLOR, out);
+    vec3_mult(out, a, out);
+
+    vec3_t scratch;
+    vec3_mult(WHITE_COLOR, 1.0f - a, scratch);
+
+    vec3_add(out, scratch, out);
+    //vec3_copy(FILL_COLOR, out);
+}
+
+// State a path carries from one vertex to the next
+struct path_state
+{
+    // Product of the attenuations so far
+    vec3_t throughput;
+    // Light gathered so far
+    vec3_t radiance;
+    // Pdf with which the last vertex's material picked the current ray's direction, or 0 if the ray came
+    // from the camera or a material light sampling skips, in which case lights it hits count in full
+    float scatter_pdf;
+    int bounces;
+    sampler_t sampler;
+};
+
+// Starts a path with the rest of a sample whose camera ray took its first dimensions
+static void path_state_init(struct path_state* state, const sampler_t* sampler)
+{
+    state->sampler = *sampler;
+    vec3_fill(state->throughput, 1.0f);
+    vec3_zero(state->radiance);
+    state->scatter_pdf = 0.0f;
+    state->bounces = 0;
+}
+
+// Adds light arriving along dir, weighted by the throughput
+static void path_add_light(struct path_state* state, const vec3_t light, float weight)
+{
+    vec3_t contribution;
+    vec3_element_mult(light, state->throughput, contribution);
+    vec3_mult(contribution, weight, contribution);
+    vec3_add(state->radiance, contribution, state->radiance);
+}
+
+// Weight of a sample from the strategy with pdf against one other strategy with pdf other_pdf, by the power
+// heuristic
+static float mis_weight(float pdf, float other_pdf)
+{
+    const float pdf_sq = pdf * pdf;
+    return pdf_sq / (pdf_sq + other_pdf * other_pdf);
+}
+
+// Next event estimation: picks a point on a light, and if nothing blocks it, adds the light it sends
+// toward the hit, weighted against the chance that scattering would have found the same point
+static void path_sample_light(const struct scene* scene, const ray_t* ray, const ray_hit_t* hit, struct path_state* state)
+{
+    float u[3];
+    u[0] = sampler_next_1d(&state->sampler);
+    sampler_next_2d(&state->sampler, &u[1]);
+    light_sample_t light;
+    if (!scene_sample_light(scene, hit->position, u, &light)) return;
+
+    vec3_t bsdf;
+    float scatter_pdf;
+    if (!material_eval(hit->material, ray, hit, light.dir, bsdf, &scatter_pdf) || scatter_pdf == 0.0f) return;
+
+    ray_t shadow_ray;
+    vec3_copy(hit->position, shadow_ray.begin);
+    vec3_copy(light.dir, shadow_ray.dir);
+    if (ray_occluded_scene(&shadow_ray, scene, 0.001f, light.distance * (1.0f - SHADOW_RAY_END_MARGIN))) return;
+
+    vec3_t incoming;
+    vec3_element_mult(light.emission, bsdf, incoming);
+    const float cos_theta = vec3_dot(hit->normal, light.dir);
+    path_add_light(state, incoming, cos_theta / light.pdf * mis_weight(light.pdf, scatter_pdf));
+}
+
+// Russian roulette once a path has scattered at the given bounce. After roulette_min_bounces, a path
+// survives with probability equal to its largest throughput component, and survivors are divided by
+// that probability, so dim paths end early while the expected result is unchanged
+static bool path_survives_roulette(const render_settings_t* settings, struct path_state* state)
+{
+    if (state->bounces + 1 < settings->roulette_min_bounces) return true;
+
+    const float survival = fminf(vec3_max_component(state->throughput), ROULETTE_MAX_SURVIVAL);
+    if (sampler_next_1d(&state->sampler) >= survival) return false;
+    vec3_div(state->throughput, survival, state->throughput);
+    return true;
+}
+
+static void path_miss(const ray_t* ray, struct path_state* state)
+{
+    vec3_t background;
+    background_color(ray->dir, background);
+    path_add_light(state, background, 1.0f);
+}
+
+// Gathers the light at a hit and scatters the path into *ray, which led to the hit. Returns false once the
+// path ends
+static bool path_hit(const struct scene* scene, const render_settings_t* settings, ray_t* ray, const ray_hit_t* hit,
+    struct path_state* state)
+{
+    vec3_t emission;
+    if (material_emit(hit->material, emission))
+    {
+        // Lights that next event estimation at the last vertex could have sampled share their weight with it
+        const float weight = settings->next_event_estimation && state->scatter_pdf > 0.0f ?
+            mis_weight(state->scatter_pdf, scene_light_pdf(scene, ray->begin, hit)) : 1.0f;
+        path_add_light(state, emission, weight);
+    }
+    // At the vertex max_bounces ends the path, the scattered ray that would share the light's MIS weight is
+    // never traced, so the light is left out there as it is without next event estimation
+    if (settings->next_event_estimation && state->bounces + 1 < settings->max_bounces)
     {
-        vec3_zero(pixel);
-        return;
+        path_sample_light(scene, ray, hit, state);
     }
 
-    ray_hit_t hit;
-    if (ray_intersect_scene(ray, scene, 0.001f, INFINITY, &hit))
+    float u[3];
+    sampler_next_2d(&state->sampler, u);
+    u[2] = sampler_next_1d(&state->sampler);
+    bsdf_sample_t sample;
+    if (!material_sample(hit->material, ray, hit, u, &sample)) return false;
+    const bool specular = bsdf_lobe_is_specular(sample.lobe);
+    const float cos_theta = specular ? 1.0f : fabsf(vec3_dot(hit->normal, sample.dir));
+    vec3_element_mult(state->throughput, sample.bsdf, state->throughput);
+    vec3_mult(state->throughput, cos_theta / sample.pdf, state->throughput);
+    if (!path_survives_roulette(settings, state)) return false;
+    if (++state->bounces >= settings->max_bounces) return false;
+
+    state->scatter_pdf = specular ? 0.0f : sample.pdf;
+    vec3_copy(hit->position, ray->begin);
+    vec3_copy(sample.dir, ray->dir);
+    return true;
+}
+
+// Follows one path to its end. If first_hit is not NULL, the camera ray was already traced and
+// first_found and first_hit are its result
+static void render_path(const struct scene* scene, const render_settings_t* settings, const ray_t* camera_ray,
+    const sampler_t* sampler, bool first_found, const ray_hit_t* first_hit, vec3_t out)
+{
+    ray_t ray = *camera_ray;
+    struct path_state state;
+    path_state_init(&state, sampler);
+
+    while (true)
     {
-        ray_t bounce_ray;
-        vec3_t attenuation;
-        vec3_t emission;
-        material_emit(hit.material, emission);
-        if (material_scatter(hit.material, ray, &hit, &bounce_ray, attenuation))
+        ray_hit_t hit;
+        bool found;
+        if (state.bounces == 0 && first_hit)
         {
-            render_pixel(scene, &bounce_ray, pixel, bounces+1);
-            vec3_element_mult(pixel, attenuation, pixel);
-            vec3_add(pixel, emission, pixel);
+            found = first_found;
+            hit = *first_hit;
         }
         else
         {
-            vec3_copy(emission, pixel);
+            found = ray_intersect_scene(&ray, scene, 0.001f, INFINITY, &hit);
+        }
+
+        if (!found)
+        {
+            path_miss(&ray, &state);
+            break;
         }
+        if (!path_hit(scene, settings, &ray, &hit, &state)) break;
     }
-    else
-    {
-        float a = (ray->dir[1] + 1.0f) / 2.0f;
+    vec3_copy(state.radiance, out);
+}
+
+// A copy of the scene for the threads of one NUMA node, made by the first of them to start
+struct render_replica
+{
+    pthread_mutex_t lock;
+    bool built;
+    scene_t scene;
+};
 
-        vec3_copy(FILL_COLOR, pixel);
-        vec3_mult(pixel, a, pixel);
+// Replicas of one scene, one per NUMA node by index, kept by an accumulator across its passes
+struct render_replicas
+{
+    const struct scene* scene;
+    size_t num_nodes;
+    struct render_replica* nodes;
+};
 
-        vec3_t scratch;
-        vec3_mult(WHITE_COLOR, 1.0f - a, scratch);
+// Room for a replica on every node with a CPU, each made the first time a thread on that node needs it
+static struct render_replicas* render_replicas_new(const struct scene* scene, size_t num_nodes)
+{
+    struct render_replicas* self = malloc(sizeof(struct render_replicas));
+    self->scene = scene;
+    self->num_nodes = num_nodes;
+    self->nodes = calloc(num_nodes, sizeof(struct render_replica));
+    for (size_t node = 0; node < num_nodes; node++)
+    {
+        pthread_mutex_init(&self->nodes[node].lock, NULL);
+    }
+    return self;
+}
 
-        vec3_add(pixel, scratch, pixel);
-        //vec3_copy(FILL_COLOR, pixel);
+static void render_replicas_free(struct render_replicas* self)
+{
+    if (!self) return;
+    for (size_t node = 0; node < self->num_nodes; node++)
+    {
+        if (self->nodes[node].built)
+        {
+            scene_replica_destroy(&self->nodes[node].scene);
+        }
+        pthread_mutex_destroy(&self->nodes[node].lock);
     }
+    free(self->nodes);
+    free(self);
 }
 
+// Shared by every thread of a pass
+struct render_frame
+{
+    const struct scene* scene;
+    struct render_pixel* accumulated;
+    // Samples each pixel should have by the end of the pass
+    uint32_t target_samples;
+    size_t num_tiles_x;
+    size_t num_tiles;
+    // Index of the next tile to hand out, in row major order
+    atomic_size_t next_tile;
+    // One per NUMA node by index, or NULL when every thread reads the scene itself
+    struct render_replica* replicas;
+};
+
+// One per thread
 struct render_task_args
 {
+    // The frame's scene or this thread's node's replica of it
     const struct scene* scene;
-    vec3_t* pixels;
-    size_t row_start;
-    size_t row_end;
+    const render_settings_t* settings;
     size_t width;
     size_t height;
+    float half_viewport_width;
+    float half_viewport_height;
+    struct render_frame* frame;
+    // SIZE_MAX, which pin_thread_to_cpu rejects, where no CPU is known
+    size_t cpu;
+    size_t node;
 };
 
-static void* render_task(void* _args)
+// The samples a pixel has taken so far. Written to checkpoints as is
+struct render_pixel
 {
-    uint64_t tid = (uint64_t) pthread_self();
-    pcg32_srandom(800, tid);
-    struct render_task_args* args = (struct render_task_args*) _args;
-    const camera_t* cam = &args->scene->camera;
+    vec3_t sum;
+    uint32_t num_samples;
+    // Running mean of the samples' luminance and sum of squared differences from it, by Welford's method
+    float luminance_mean;
+    float luminance_m2;
+};
 
-    const float half_viewport_height = tanf(cam->fov) * cam->near;
-    const float half_viewport_width = half_viewport_height * cam->aspect;
+static void render_pixel_add_sample(struct render_pixel* pixel, const vec3_t color)
+{
+    vec3_add(pixel->sum, color, pixel->sum);
+    pixel->num_samples++;
+
+    const float luminance = vec3_luminance(color);
+    const float delta = luminance - pixel->luminance_mean;
+    pixel->luminance_mean += delta / pixel->num_samples;
+    pixel->luminance_m2 += delta * (luminance - pixel->luminance_mean);
+}
 
-    for (size_t row = args->row_start; row <= args->row_end; row++)
+// Most samples any pixel takes
+static size_t render_max_samples(const render_settings_t* settings)
+{
+    if (settings->adaptive_error <= 0.0f) return settings->num_samples;
+    return settings->adaptive_max_samples > 0 ? settings->adaptive_max_samples :
+        settings->num_samples * ADAPTIVE_MAX_SAMPLES_FACTOR;
+}
+
+// Whether the pixel has taken all the samples it needs by the end of a pass with the given target
+static bool render_pixel_done(const render_settings_t* settings, const struct render_pixel* pixel, uint32_t target_samples)
+{
+    const uint32_t n = pixel->num_samples;
+    if (n >= target_samples) return true;
+    if (settings->adaptive_error <= 0.0f || n < settings->adaptive_min_samples || n < 2 ||
+        n % ADAPTIVE_CHECK_INTERVAL != 0)
     {
-        for (size_t col = 0; col < args->width; col++)
-        {
-            float* pixel = args->pixels[row * args->width + col];
-            vec3_zero(pixel);
+        return false;
+    }
 
-            for (size_t sample = 0; sample < NUM_SAMPLES; sample++)
-            {
-                const float ndc_x = (col + rand_unit_float_signed()) / args->width * 2.0f - 1.0f;
-                const float view_x = ndc_x * half_viewport_width;
-                const float ndc_y = (row + rand_unit_float_signed()) / args->height * 2.0f - 1.0f;
-                const float view_y = ndc_y * half_viewport_height;
+    // Samples that all agree, such as a pixel in shadow that has not yet found a path to the light, give
+    // no variance to go on, so the estimate is taken as if one more sample had differed by the floor
+    const float m2 = pixel->luminance_m2 + ADAPTIVE_MIN_LUMINANCE * ADAPTIVE_MIN_LUMINANCE;
+    const float standard_error = sqrtf(m2 / ((float) n * (n - 1)));
+    return standard_error < settings->adaptive_error * fmaxf(pixel->luminance_mean, ADAPTIVE_MIN_LUMINANCE);
+}
+
+// Pixels in [col_begin, col_end) x [row_begin, row_end). Samples are summed into a buffer owned by the
+// thread rendering the tile, with rows RENDER_TILE_SIZE apart, so threads never write to cache lines
+// they share and the accumulated samples are only written once the tile is finished
+struct render_tile
+{
+    size_t col_begin;
+    size_t col_end;
+    size_t row_begin;
+    size_t row_end;
+    struct render_pixel* pixels;
+};
+
+static struct render_pixel* render_tile_pixel(const struct render_tile* tile, size_t col, size_t row)
+{
+    assert(tile->pixels);
+    return &tile->pixels[(row - tile->row_begin) * RENDER_TILE_SIZE + col - tile->col_begin];
+}
+
+// Takes the next tile no thread has rendered yet in this pass, leaving its pixels unset. Returns false
+// once the frame is covered
+static bool render_next_tile(struct render_task_args* args, struct render_tile* out)
+{
+    struct render_frame* frame = args->frame;
+    const size_t index = atomic_fetch_add_explicit(&frame->next_tile, 1, memory_order_relaxed);
+    if (index >= frame->num_tiles) return false;
+
+    out->col_begin = index % frame->num_tiles_x * RENDER_TILE_SIZE;
+    out->row_begin = index / frame->num_tiles_x * RENDER_TILE_SIZE;
+    out->col_end = out->col_begin + RENDER_TILE_SIZE < args->width ? out->col_begin + RENDER_TILE_SIZE : args->width;
+    out->row_end = out->row_begin + RENDER_TILE_SIZE < args->height ? out->row_begin + RENDER_TILE_SIZE : args->height;
+    return true;
+}
+
+// Copies the samples the tile's pixels took in earlier passes into its buffer
+static void render_load_tile(const struct render_task_args* args, const struct render_tile* tile)
+{
+    for (size_t row = tile->row_begin; row < tile->row_end; row++)
+    {
+        memcpy(render_tile_pixel(tile, tile->col_begin, row), &args->frame->accumulated[row * args->width + tile->col_begin],
+            (tile->col_end - tile->col_begin) * sizeof(struct render_pixel));
+    }
+}
+
+static void render_store_tile(const struct render_task_args* args, const struct render_tile* tile)
+{
+    for (size_t row = tile->row_begin; row < tile->row_end; row++)
+    {
+        memcpy(&args->frame->accumulated[row * args->width + tile->col_begin], render_tile_pixel(tile, tile->col_begin, row),
+            (tile->col_end - tile->col_begin) * sizeof(struct render_pixel));
+    }
+}
+
+// In NUMA aware mode, pins the thread to its CPU and switches it to its node's replica of the scene,
+// building the replica if this is the node's first thread
+static void render_worker_init(struct render_task_args* args)
+{
+    if (!args->settings->numa_aware) return;
+
+    pin_thread_to_cpu(args->cpu);
+    struct render_frame* frame = args->frame;
+    if (!frame->replicas) return;
+
+    struct render_replica* replica = &frame->replicas[args->node];
+    pthread_mutex_lock(&replica->lock);
+    if (!replica->built)
+    {
+        scene_replicate(frame->scene, &replica->scene);
+        replica->built = true;
+    }
+    pthread_mutex_unlock(&replica->lock);
+    args->scene = &replica->scene;
+}
+
+// Starts the sampler on sample index of the pixel at col and row
+static void render_start_sample(const struct render_task_args* args, size_t col, size_t row, uint32_t index, sampler_t* out)
+{
+    sampler_start(out, args->settings->sampler, args->settings->seed, row * args->width + col, index);
+}
+
+// A ray through the pixel at col and row, starting on the camera's defocus disk, from the first
+// dimensions of the sample
+static void render_camera_ray(const struct render_task_args* args, size_t col, size_t row, sampler_t* sampler, ray_t* out)
+{
+    const camera_t* cam = &args->scene->camera;
+    float jitter[2];
+    sampler_next_2d(sampler, jitter);
+    const float ndc_x = (col + jitter[0] * 2.0f - 1.0f) / args->width * 2.0f - 1.0f;
+    const float view_x = ndc_x * args->half_viewport_width;
+    const float ndc_y = (row + jitter[1] * 2.0f - 1.0f) / args->height * 2.0f - 1.0f;
+    const float view_y = ndc_y * args->half_viewport_height;
 
-                vec3_t world_look;
-                camera_view_to_world(cam, (vec3_t){view_x, view_y, cam->near}, world_look);
+    vec3_t world_look;
+    camera_view_to_world(cam, (vec3_t){view_x, view_y, cam->near}, world_look);
 
+    float lens[2];
+    sampler_next_2d(sampler, lens);
+    camera_sample_defocus_disk(cam, lens, out->begin);
+    vec3_sub(world_look, out->begin, out->dir);
+    vec3_normalize(out->dir, out->dir);
+}
+
+static void render_tile(const struct render_task_args* args, const struct render_tile* tile)
+{
+    for (size_t row = tile->row_begin; row < tile->row_end; row++)
+    {
+        for (size_t col = tile->col_begin; col < tile->col_end; col++)
+        {
+            struct render_pixel* pixel = render_tile_pixel(tile, col, row);
+            while (!render_pixel_done(args->settings, pixel, args->frame->target_samples))
+            {
+                sampler_t sampler;
+                render_start_sample(args, col, row, pixel->num_samples, &sampler);
                 ray_t ray;
-                camera_random_in_defocus_disk_world_space(cam, ray.begin);
-                vec3_sub(world_look, ray.begin, ray.dir);
-                vec3_normalize(ray.dir, ray.dir);
+                render_camera_ray(args, col, row, &sampler, &ray);
            
                 vec3_t sample_color;
-                render_pixel(args->scene, &ray, sample_color, 0);
-                vec3_add(pixel, sample_color, pixel);
+                render_path(args->scene, args->settings, &ray, &sampler, false, NULL, sample_color);
+                render_pixel_add_sample(pixel, sample_color);
+            }
+        }
+    }
+}
+
+// Renders the tile in blocks of PRIMARY_PACKET_WIDTH by PRIMARY_PACKET_WIDTH pixels. Each sample of a
+// block traces the camera rays of all its pixels as one packet, since rays through neighbouring pixels
+// mostly visit the same BVH nodes, and then follows each path on its own from its first hit. Packets
+// shrink as adaptive sampling finishes pixels of the block
+static void render_packet_tile(const struct render_task_args* args, const struct render_tile* tile)
+{
+    for (size_t row_begin = tile->row_begin; row_begin < tile->row_end; row_begin += PRIMARY_PACKET_WIDTH)
+    {
+        for (size_t col_begin = tile->col_begin; col_begin < tile->col_end; col_begin += PRIMARY_PACKET_WIDTH)
+        {
+            // Blocks at the bottom and right edges of the image are cut short
+            size_t cols[RAY_PACKET_SIZE];
+            size_t rows[RAY_PACKET_SIZE];
+            size_t num_pixels = 0;
+            for (size_t row = row_begin; row < tile->row_end && row < row_begin + PRIMARY_PACKET_WIDTH; row++)
+            {
+                for (size_t col = col_begin; col < tile->col_end && col < col_begin + PRIMARY_PACKET_WIDTH; col++)
+                {
+                    cols[num_pixels] = col;
+                    rows[num_pixels++] = row;
+                }
+            }
+
+            while (true)
+            {
+                struct render_pixel* pixels[RAY_PACKET_SIZE];
+                sampler_t samplers[RAY_PACKET_SIZE];
+                ray_t rays[RAY_PACKET_SIZE];
+                size_t num_rays = 0;
+                for (size_t i = 0; i < num_pixels; i++)
+                {
+                    struct render_pixel* pixel = render_tile_pixel(tile, cols[i], rows[i]);
+                    if (render_pixel_done(args->settings, pixel, args->frame->target_samples)) continue;
+                    pixels[num_rays] = pixel;
+                    render_start_sample(args, cols[i], rows[i], pixel->num_samples, &samplers[num_rays]);
+                    render_camera_ray(args, cols[i], rows[i], &samplers[num_rays], &rays[num_rays]);
+                    num_rays++;
+                }
+                if (num_rays == 0) break;
+
+                ray_hit_t hits[RAY_PACKET_SIZE];
+                bool found[RAY_PACKET_SIZE];
+                ray_intersect_scene_packet(rays, num_rays, args->scene, 0.001f, INFINITY, hits, found);
+
+                for (size_t i = 0; i < num_rays; i++)
+                {
+                    vec3_t sample_color;
+                    render_path(args->scene, args->settings, &rays[i], &samplers[i], found[i], &hits[i], sample_color);
+                    render_pixel_add_sample(pixels[i], sample_color);
+                }
             }
-            vec3_div(pixel, NUM_SAMPLES, pixel);
-            linear_to_gamma(pixel);
         }
     }
+}
+
+// Renders tiles until none are left, so every thread stays busy until the frame is nearly done
+static void* render_task(void* _args)
+{
+    struct render_task_args* args = (struct render_task_args*) _args;
+    render_worker_init(args);
+
+    struct render_pixel tile_pixels[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+    struct render_tile tile;
+    tile.pixels = tile_pixels;
+    while (render_next_tile(args, &tile))
+    {
+        render_load_tile(args, &tile);
+        if (args->settings->primary_packets)
+        {
+            render_packet_tile(args, &tile);
+        }
+        else
+        {
+            render_tile(args, &tile);
+        }
+        render_store_tile(args, &tile);
+    }
     return NULL;
 }
 
-void render(const struct scene* scene, vec3_t* pixels, size_t width, size_t height)
+// State a path carries between wavefront stages
+struct wavefront_path
+{
+    ray_t ray;
+    struct path_state state;
+    struct wavefront_tile* tile;
+    // Where the path's radiance goes when it ends, in its tile's samples
+    vec3_t* sample;
+};
+
+// Indices of the queued paths by what they hit, with misses in the last bin
+#define WAVEFRONT_NUM_BINS (MATERIAL_TYPE_COUNT + 1)
+
+struct wavefront_queue
+{
+    struct wavefront_path paths[WAVEFRONT_QUEUE_SIZE];
+    ray_hit_t hits[WAVEFRONT_QUEUE_SIZE];
+    bool hit_found[WAVEFRONT_QUEUE_SIZE];
+    bool alive[WAVEFRONT_QUEUE_SIZE];
+    uint32_t order[WAVEFRONT_QUEUE_SIZE];
+    size_t num_paths;
+};
+
+// A tile a wavefront thread has taken. Paths of its pixels finish in an order that depends on the other
+// paths in the queue, so their radiance is kept until the last one ends and then added to each pixel in
+// the order of the samples, making the image independent of how tiles were spread over threads
+struct wavefront_tile
+{
+    struct render_tile tile;
+    // One per sample the pass takes in the tile, by pixel in row major order, then by sample index
+    vec3_t* samples;
+    size_t num_samples;
+    size_t num_generated;
+    size_t num_finished;
+    // Camera rays are still being generated for its pixels, which are read until generation moves past
+    // the last of them even once every sample has been generated
+    bool generating;
+};
+
+// The tiles a wavefront thread has taken. Paths of a tile are still in flight after its last camera ray
+// is generated, so each is stored once generation has moved past it and its last path has ended
+struct wavefront_tiles
 {
-    pthread_t threads[NUM_THREADS];
-    struct render_task_args args[NUM_THREADS];
-    const size_t rows_per_thread = height / NUM_THREADS;
+    struct wavefront_tile* tiles;
+    size_t num_tiles;
+    // Camera rays are being generated for the pixel before this one of the last tile, in row major order
+    size_t next_pixel;
+    size_t samples_left;
+    // Index of the pixel's next sample
+    uint32_t next_sample_index;
+};
 
-    for (size_t i = 0; i < NUM_THREADS; i++)
+// Samples the pass takes of the pixel, which stay the same until its tile is finished
+static size_t wavefront_pixel_samples(const struct render_task_args* args, const struct render_pixel* pixel)
+{
+    const uint32_t target_samples = args->frame->target_samples;
+    return render_pixel_done(args->settings, pixel, target_samples) ? 0 : target_samples - pixel->num_samples;
+}
+
+// Adds the tile's samples to its pixels in order and stores it
+static void wavefront_finish_tile(const struct render_task_args* args, struct wavefront_tile* tile)
+{
+    const vec3_t* sample = tile->samples;
+    for (size_t row = tile->tile.row_begin; row < tile->tile.row_end; row++)
     {
-        args[i].scene = scene;
-        args[i].pixels = pixels;
-        args[i].row_start = rows_per_thread * i;
-        args[i].row_end = rows_per_thread * (i + 1) - 1;
-        args[i].width = width;
-        args[i].height = height;
+        for (size_t col = tile->tile.col_begin; col < tile->tile.col_end; col++)
+        {
+            struct render_pixel* pixel = render_tile_pixel(&tile->tile, col, row);
+            const size_t num_samples = wavefront_pixel_samples(args, pixel);
+            for (size_t i = 0; i < num_samples; i++)
+            {
+                render_pixel_add_sample(pixel, *sample++);
+            }
+        }
+    }
+    render_store_tile(args, &tile->tile);
+    free(tile->tile.pixels);
+    free(tile->samples);
+    tile->tile.pixels = NULL;
+    tile->samples = NULL;
+}
+
+// Finishes the tile if generation has moved past it and none of its paths are in flight
+static void wavefront_try_finish_tile(const struct render_task_args* args, struct wavefront_tile* tile)
+{
+    if (!tile->generating && tile->num_finished == tile->num_samples)
+    {
+        wavefront_finish_tile(args, tile);
+    }
+}
+
+// Ends generation for the tile taken last, if any, and takes the next one, making room for its samples.
+// Returns false once there are no tiles left
+static bool wavefront_take_tile(struct render_task_args* args, struct wavefront_tiles* tiles)
+{
+    if (tiles->num_tiles > 0 && tiles->tiles[tiles->num_tiles - 1].generating)
+    {
+        struct wavefront_tile* last = &tiles->tiles[tiles->num_tiles - 1];
+        last->generating = false;
+        wavefront_try_finish_tile(args, last);
+    }
+
+    struct wavefront_tile* tile = &tiles->tiles[tiles->num_tiles];
+    if (!render_next_tile(args, &tile->tile)) return false;
+    tiles->num_tiles++;
+    tiles->next_pixel = 0;
+    tile->tile.pixels = malloc(RENDER_TILE_SIZE * RENDER_TILE_SIZE * sizeof(struct render_pixel));
+    render_load_tile(args, &tile->tile);
+
+    tile->num_samples = 0;
+    tile->num_generated = 0;
+    tile->num_finished = 0;
+    tile->generating = true;
+    for (size_t row = tile->tile.row_begin; row < tile->tile.row_end; row++)
+    {
+        for (size_t col = tile->tile.col_begin; col < tile->tile.col_end; col++)
+        {
+            tile->num_samples += wavefront_pixel_samples(args, render_tile_pixel(&tile->tile, col, row));
+        }
+    }
+    tile->samples = malloc(tile->num_samples * sizeof(vec3_t));
+    return true;
+}
+
+// Records the radiance of a path that ended, finishing its tile if it was the last
+static void wavefront_end_path(const struct render_task_args* args, struct wavefront_path* path)
+{
+    vec3_copy(path->state.radiance, *path->sample);
+    path->tile->num_finished++;
+    wavefront_try_finish_tile(args, path->tile);
+}
+
+// Fills the free end of the queue with camera rays for the next samples, taking new tiles as needed.
+// Each pixel's samples are all generated before its first completes, so adaptive sampling only stops
+// pixels that converged in earlier passes
+static void wavefront_generate(struct render_task_args* args, struct wavefront_queue* queue, struct wavefront_tiles* tiles)
+{
+    while (queue->num_paths < WAVEFRONT_QUEUE_SIZE)
+    {
+        while (tiles->samples_left == 0)
+        {
+            const struct render_tile* tile = tiles->num_tiles > 0 ? &tiles->tiles[tiles->num_tiles - 1].tile : NULL;
+            if (!tile || tiles->next_pixel == (tile->col_end - tile->col_begin) * (tile->row_end - tile->row_begin))
+            {
+                if (!wavefront_take_tile(args, tiles)) return;
+                tile = &tiles->tiles[tiles->num_tiles - 1].tile;
+            }
+
+            const size_t tile_width = tile->col_end - tile->col_begin;
+            const size_t col = tile->col_begin + tiles->next_pixel % tile_width;
+            const size_t row = tile->row_begin + tiles->next_pixel / tile_width;
+            const struct render_pixel* pixel = render_tile_pixel(tile, col, row);
+            tiles->samples_left = wavefront_pixel_samples(args, pixel);
+            tiles->next_sample_index = pixel->num_samples;
+            tiles->next_pixel++;
+        }
+
+        struct wavefront_tile* tile = &tiles->tiles[tiles->num_tiles - 1];
+        const size_t tile_width = tile->tile.col_end - tile->tile.col_begin;
+        const size_t col = tile->tile.col_begin + (tiles->next_pixel - 1) % tile_width;
+        const size_t row = tile->tile.row_begin + (tiles->next_pixel - 1) / tile_width;
+        struct wavefront_path* path = &queue->paths[queue->num_paths++];
+        sampler_t sampler;
+        render_start_sample(args, col, row, tiles->next_sample_index++, &sampler);
+        render_camera_ray(args, col, row, &sampler, &path->ray);
+        path_state_init(&path->state, &sampler);
+        path->tile = tile;
+        path->sample = &tile->samples[tile->num_generated++];
+        tiles->samples_left--;
+    }
+}
+
+static void wavefront_extend(const struct scene* scene, struct wavefront_queue* queue)
+{
+    for (size_t i = 0; i < queue->num_paths; i++)
+    {
+        queue->hit_found[i] = ray_intersect_scene(&queue->paths[i].ray, scene, 0.001f, INFINITY, &queue->hits[i]);
+    }
+}
+
+// Counting sort of the queue by bin, so that shading runs over all paths of one material type at once
+static void wavefront_sort(struct wavefront_queue* queue, size_t bin_start[WAVEFRONT_NUM_BINS + 1])
+{
+    size_t counts[WAVEFRONT_NUM_BINS] = {0};
+    uint8_t bins[WAVEFRONT_QUEUE_SIZE];
+    for (size_t i = 0; i < queue->num_paths; i++)
+    {
+        bins[i] = queue->hit_found[i] ? queue->hits[i].material->type : MATERIAL_TYPE_COUNT;
+        counts[bins[i]]++;
+    }
+    bin_start[0] = 0;
+    for (size_t bin = 0; bin < WAVEFRONT_NUM_BINS; bin++)
+    {
+        bin_start[bin + 1] = bin_start[bin] + counts[bin];
+    }
+
+    size_t next[WAVEFRONT_NUM_BINS];
+    memcpy(next, bin_start, sizeof(next));
+    for (size_t i = 0; i < queue->num_paths; i++)
+    {
+        queue->order[next[bins[i]]++] = i;
+    }
+}
+
+static void wavefront_shade_misses(const struct render_task_args* args, struct wavefront_queue* queue, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        const uint32_t index = queue->order[i];
+        struct wavefront_path* path = &queue->paths[index];
+        path_miss(&path->ray, &path->state);
+        wavefront_end_path(args, path);
+        queue->alive[index] = false;
+    }
+}
+
+// Same steps as one iteration of render_path, run over every path that hit one material type
+static void wavefront_shade_hits(const struct render_task_args* args, struct wavefront_queue* queue, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        const uint32_t index = queue->order[i];
+        struct wavefront_path* path = &queue->paths[index];
+        const bool alive = path_hit(args->scene, args->settings, &path->ray, &queue->hits[index], &path->state);
+        if (!alive)
+        {
+            wavefront_end_path(args, path);
+        }
+        queue->alive[index] = alive;
+    }
+}
 
-        if (i == NUM_THREADS - 1)
+// Moves the paths still alive to the front of the queue, keeping their order
+static void wavefront_compact(struct wavefront_queue* queue)
+{
+    size_t num_alive = 0;
+    for (size_t i = 0; i < queue->num_paths; i++)
+    {
+        if (queue->alive[i])
         {
-            args[i].row_end = height - 1;
+            queue->paths[num_alive++] = queue->paths[i];
         }
-        pthread_create(&threads[i], NULL, render_task, &args[i]);
     }
+    queue->num_paths = num_alive;
+}
 
-    for (size_t i = 0; i < NUM_THREADS; i++)
+// Renders tiles a queue of paths at a time instead of one path at a time. Each stage runs
+// over the whole queue before the next starts, so traversal and each material's shading run as tight
+// loops with their own code and data in cache, and finished paths are replaced by new samples between
+// bounces to keep the queue full
+static void* render_wavefront_task(void* _args)
+{
+    struct render_task_args* args = (struct render_task_args*) _args;
+    render_worker_init(args);
+
+    struct wavefront_tiles tiles = {.tiles = malloc(args->frame->num_tiles * sizeof(struct wavefront_tile))};
+    struct wavefront_queue* queue = malloc(sizeof(struct wavefront_queue));
+    queue->num_paths = 0;
+    while (true)
+    {
+        wavefront_generate(args, queue, &tiles);
+        if (queue->num_paths == 0) break;
+
+        wavefront_extend(args->scene, queue);
+
+        size_t bin_start[WAVEFRONT_NUM_BINS + 1];
+        wavefront_sort(queue, bin_start);
+        for (size_t bin = 0; bin < MATERIAL_TYPE_COUNT; bin++)
+        {
+            wavefront_shade_hits(args, queue, bin_start[bin], bin_start[bin + 1]);
+        }
+        wavefront_shade_misses(args, queue, bin_start[MATERIAL_TYPE_COUNT], bin_start[WAVEFRONT_NUM_BINS]);
+
+        wavefront_compact(queue);
+    }
+    free(queue);
+    free(tiles.tiles);
+    return NULL;
+}
+
+void render_settings_default(render_settings_t* out)
+{
+    out->mode = RENDER_MODE_PATH;
+    out->num_samples = NUM_SAMPLES;
+    out->max_bounces = MAX_RAY_BOUNCES;
+    out->roulette_min_bounces = ROULETTE_MIN_BOUNCES;
+    out->primary_packets = true;
+    out->sampler = SAMPLER_SOBOL;
+    out->seed = 0;
+    out->num_threads = 0;
+    out->numa_aware = false;
+    out->adaptive_error = ADAPTIVE_ERROR;
+    out->adaptive_min_samples = ADAPTIVE_MIN_SAMPLES;
+    out->adaptive_max_samples = 0;
+    out->next_event_estimation = true;
+}
+
+uint64_t render_settings_hash(const render_settings_t* self, uint64_t hash)
+{
+    const uint64_t counts[] = {self->num_samples, self->max_bounces, self->roulette_min_bounces,
+        self->next_event_estimation, self->sampler, self->seed, self->adaptive_min_samples, self->adaptive_max_samples};
+    hash = hash_bytes(counts, sizeof(counts), hash);
+    return hash_bytes(&self->adaptive_error, sizeof(float), hash);
+}
+
+void render_pass(const struct scene* scene, const render_settings_t* settings, render_accumulator_t* accumulator,
+    size_t target_samples)
+{
+    const size_t width = accumulator->width;
+    const size_t height = accumulator->height;
+    const camera_t* cam = &scene->camera;
+    const float half_viewport_height = tanf(cam->fov) * cam->near;
+    struct render_frame frame = {
+        .scene = scene,
+        .accumulated = accumulator->pixels,
+        .target_samples = target_samples < render_max_samples(settings) ? target_samples : render_max_samples(settings),
+        .num_tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE,
+        .replicas = NULL
+    };
+    frame.num_tiles = frame.num_tiles_x * ((height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE);
+    atomic_init(&frame.next_tile, 0);
+
+    const size_t num_threads = settings->num_threads > 0 ? settings->num_threads : get_num_cpus();
+    // Workers are spread over the CPUs the process may run on, which leaves them unpinned where that set
+    // is unknown
+    size_t num_affinity_cpus = 0;
+    size_t* affinity_cpus = settings->numa_aware ? get_affinity_cpus(&num_affinity_cpus) : NULL;
+    struct render_task_args* args = malloc(num_threads * sizeof(struct render_task_args));
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        args[i] = (struct render_task_args) {
+            .scene = scene,
+            .settings = settings,
+            .width = width,
+            .height = height,
+            .half_viewport_width = half_viewport_height * cam->aspect,
+            .half_viewport_height = half_viewport_height,
+            .frame = &frame,
+            .cpu = SIZE_MAX,
+            .node = 0
+        };
+        if (num_affinity_cpus > 0)
+        {
+            args[i].cpu = affinity_cpus[i % num_affinity_cpus];
+            args[i].node = get_cpu_numa_node(args[i].cpu);
+        }
+    }
+
+    if (settings->numa_aware)
+    {
+        // Replicas of another scene are stale, and a pass over it would have to make them again anyway
+        if (accumulator->replicas && accumulator->replicas->scene != scene)
+        {
+            render_replicas_free(accumulator->replicas);
+            accumulator->replicas = NULL;
+        }
+        if (!accumulator->replicas)
+        {
+            // Sized for every CPU the process may run on rather than this pass's threads, so that later
+            // passes with more threads still find room
+            size_t num_nodes = 1;
+            for (size_t i = 0; i < num_affinity_cpus; i++)
+            {
+                const size_t node = get_cpu_numa_node(affinity_cpus[i]);
+                num_nodes = node + 1 > num_nodes ? node + 1 : num_nodes;
+            }
+            // With a single node, pinning is all NUMA aware mode does
+            if (num_nodes > 1)
+            {
+                accumulator->replicas = render_replicas_new(scene, num_nodes);
+            }
+        }
+        frame.replicas = accumulator->replicas ? accumulator->replicas->nodes : NULL;
+    }
+    free(affinity_cpus);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        pthread_create(&threads[i], NULL, settings->mode == RENDER_MODE_WAVEFRONT ? render_wavefront_task : render_task, &args[i]);
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
     {
         pthread_join(threads[i], NULL);
     }
-}
\ No newline at end of file
+    free(threads);
+    free(args);
+}
+
+// With adaptive sampling, rounds a target up to whole check intervals, so that the pixels it stops end the
+// pass on a sample count where render_pixel_done tests them
+static size_t render_align_target(const render_settings_t* settings, size_t target)
+{
+    if (settings->adaptive_error <= 0.0f || target % ADAPTIVE_CHECK_INTERVAL == 0) return target;
+    return target + ADAPTIVE_CHECK_INTERVAL - target % ADAPTIVE_CHECK_INTERVAL;
+}
+
+size_t render_next_target(const render_settings_t* settings, const render_accumulator_t* accumulator, size_t target,
+    size_t pass_samples)
+{
+    if (target < settings->num_samples)
+    {
+        const size_t next = pass_samples < settings->num_samples - target ? target + pass_samples : settings->num_samples;
+        return render_align_target(settings, next);
+    }
+    const size_t max_samples = render_max_samples(settings);
+    if (target >= max_samples) return 0;
+
+    const size_t num_pixels = accumulator->width * accumulator->height;
+    uint64_t spent = 0;
+    size_t num_unconverged = 0;
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        spent += accumulator->pixels[i].num_samples;
+        num_unconverged += !render_pixel_done(settings, &accumulator->pixels[i], max_samples);
+    }
+    const uint64_t budget = (uint64_t) settings->num_samples * num_pixels;
+    if (num_unconverged == 0 || spent >= budget) return 0;
+
+    // Whole check intervals, so that pixels end the pass where adaptive sampling tests them
+    size_t step = (budget - spent) / num_unconverged;
+    step = step < pass_samples ? step : pass_samples;
+    step -= step % ADAPTIVE_CHECK_INTERVAL;
+    if (step == 0) return 0;
+    return target + step < max_samples ? target + step : max_samples;
+}
+
+void render(const struct scene* scene, const render_settings_t* settings, vec3_t* pixels, uint32_t* sample_counts,
+    size_t width, size_t height)
+{
+    render_accumulator_t accumulator;
+    render_accumulator_init(&accumulator, width, height, 0);
+    size_t target = render_next_target(settings, &accumulator, 0, SIZE_MAX);
+    for (; target > 0; target = render_next_target(settings, &accumulator, target, SIZE_MAX))
+    {
+        render_pass(scene, settings, &accumulator, target);
+    }
+    render_accumulator_resolve(&accumulator, pixels, sample_counts);
+    render_accumulator_destroy(&accumulator);
+}
+
+void render_accumulator_init(render_accumulator_t* self, size_t width, size_t height, uint64_t key)
+{
+    self->width = width;
+    self->height = height;
+    self->key = key;
+    self->pixels = calloc(width * height, sizeof(struct render_pixel));
+    self->replicas = NULL;
+}
+
+void render_accumulator_destroy(render_accumulator_t* self)
+{
+    free(self->pixels);
+    render_replicas_free(self->replicas);
+}
+
+void render_accumulator_resolve(const render_accumulator_t* self, vec3_t* pixels, uint32_t* sample_counts)
+{
+    for (size_t i = 0; i < self->width * self->height; i++)
+    {
+        const struct render_pixel* samples = &self->pixels[i];
+        vec3_div(samples->sum, samples->num_samples > 0 ? samples->num_samples : 1, pixels[i]);
+        linear_to_gamma(pixels[i]);
+        if (sample_counts)
+        {
+            sample_counts[i] = samples->num_samples;
+        }
+    }
+}
+
+#define CHECKPOINT_MAGIC 0x4b504352u
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t width;
+    uint64_t height;
+};
+
+bool render_accumulator_save(const render_accumulator_t* self, const char* path)
+{
+    // Written beside the checkpoint and renamed over it, so that being killed mid write leaves the last
+    // checkpoint intact
+    char temp_path[4096];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int) sizeof(temp_path)) return false;
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return false;
+
+    const struct checkpoint_header header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .key = self->key,
+        .width = self->width,
+        .height = self->height
+    };
+    const size_t num_pixels = self->width * self->height;
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(self->pixels, sizeof(struct render_pixel), num_pixels, file) == num_pixels;
+    success = fclose(file) == 0 && success;
+    if (!success || rename(temp_path, path) != 0)
+    {
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+bool render_accumulator_load(render_accumulator_t* self, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    struct checkpoint_header header;
+    const size_t num_pixels = self->width * self->height;
+    bool success = fread(&header, sizeof(header), 1, file) == 1 && header.magic == CHECKPOINT_MAGIC &&
+        header.version == CHECKPOINT_VERSION && header.key == self->key && header.width == self->width &&
+        header.height == self->height;
+    if (success)
+    {
+        struct render_pixel* pixels = malloc(num_pixels * sizeof(struct render_pixel));
+        success = fread(pixels, sizeof(struct render_pixel), num_pixels, file) == num_pixels;
+        if (success)
+        {
+            free(self->pixels);
+            self->pixels = pixels;
+        }
+        else
+        {
+            free(pixels);
+        }
+    }
+    fclose(file);
+    return success;
+}
@@ -2,9 +2,110 @@
 #define RENDERER_H
 
 #include "common.h"
+#include "sampler.h"
 
 struct scene;
+struct render_pixel;
+struct render_replicas;
 
-void render(const struct scene* scene, vec3_t* pixels, size_t width, size_t height);
+enum render_mode
+{
+    // Each thread traces one path to completion at a time
+    RENDER_MODE_PATH,
+    // Each thread keeps a queue of paths and advances all of them one stage at a time
+    RENDER_MODE_WAVEFRONT
+};
+
+typedef struct render_settings
+{
+    enum render_mode mode;
+    size_t num_samples;
+    // Paths end after this many bounces regardless of how much they still carry
+    int max_bounces;
+    // Bounces every path gets before Russian roulette may end it
+    int roulette_min_bounces;
+    // At every diffuse hit, also sample a point on a light and trace a shadow ray to it, combining the
+    // result with lights that scattered rays hit by multiple importance sampling
+    bool next_event_estimation;
+    // In path mode, trace the camera rays of neighbouring pixels together as packets
+    bool primary_packets;
+    // Source of every random decision of a path
+    enum sampler_type sampler;
+    // Picks the random numbers of the render. The same seed and settings give the same image whatever the
+    // number of threads or the order in which they take tiles
+    uint32_t seed;
+    // Worker threads, or 0 for one per CPU
+    size_t num_threads;
+    // Pin each thread to a CPU and, on machines with more than one NUMA node, give the threads of each
+    // node their own copy of the scene's acceleration structure in memory local to that node
+    bool numa_aware;
+    // Pixels stop taking samples once the standard error of their mean luminance falls below this fraction
+    // of the mean, so flat regions converge early. num_samples is then the average the image takes, and
+    // the samples converged pixels leave unspent go to the noisy ones, up to adaptive_max_samples. Wavefront
+    // mode only stops pixels between render passes. 0 gives every pixel num_samples
+    float adaptive_error;
+    // Samples every pixel takes before adaptive sampling may stop it, so that its variance estimate is
+    // trustworthy
+    size_t adaptive_min_samples;
+    // Most samples a pixel takes with adaptive sampling, or 0 for ADAPTIVE_MAX_SAMPLES_FACTOR times
+    // num_samples
+    size_t adaptive_max_samples;
+} render_settings_t;
+
+void render_settings_default(render_settings_t* out);
+
+// Continues hash, as from hash_bytes, over the settings that change the samples taken, leaving out those
+// such as the thread count and render mode that only change how fast they are taken
+uint64_t render_settings_hash(const render_settings_t* self, uint64_t hash);
+
+// The samples every pixel of an image has taken so far, kept across render passes so that a render can be
+// refined progressively and saved to resume after the process ends
+typedef struct render_accumulator
+{
+    size_t width;
+    size_t height;
+    // Identifies what is being rendered, so that a checkpoint of something else is not resumed
+    uint64_t key;
+    struct render_pixel* pixels;
+    // In NUMA aware mode on machines with more than one node, the copies of the scene its passes read,
+    // made by the first pass and kept until the accumulator is destroyed. NULL until then
+    struct render_replicas* replicas;
+} render_accumulator_t;
+
+// Renders the whole image in one pass. If sample_counts is not NULL, it receives the number of samples
+// each pixel took
+void render(const struct scene* scene, const render_settings_t* settings, vec3_t* pixels, uint32_t* sample_counts,
+    size_t width, size_t height);
+
+// Samples every pixel until it has target_samples, at most the most any pixel may take, or adaptive
+// sampling stops it. Raising the target from pass to pass gives a progressively refined image. In NUMA aware mode
+// the scene is copied to each node once and reused by later passes over the same scene, so it must not
+// change between them
+void render_pass(const struct scene* scene, const render_settings_t* settings, render_accumulator_t* accumulator,
+    size_t target_samples);
+
+// The target for the pass after one that reached target, or for the first pass when target is 0:
+// pass_samples more until every pixel has had settings->num_samples, then, with adaptive sampling, as
+// many more as the samples left in the image's budget of num_samples per pixel allow every pixel that has
+// not converged, at most pass_samples more. Adaptive targets are rounded up to the samples at which
+// convergence is tested. Returns 0 once the budget is spent, or every pixel has converged or taken the
+// most it may
+size_t render_next_target(const render_settings_t* settings, const render_accumulator_t* accumulator, size_t target,
+    size_t pass_samples);
+
+// Starts with no samples taken
+void render_accumulator_init(render_accumulator_t* self, size_t width, size_t height, uint64_t key);
+
+void render_accumulator_destroy(render_accumulator_t* self);
+
+// Writes the image so far, like render. Pixels without samples are black
+void render_accumulator_resolve(const render_accumulator_t* self, vec3_t* pixels, uint32_t* sample_counts);
+
+// Writes a checkpoint through a temporary file, replacing the file at path only once it is complete
+bool render_accumulator_save(const render_accumulator_t* self, const char* path);
+
+// Replaces the samples with those in a checkpoint. Returns false, leaving them as they were, if the file is
+// missing, unreadable, or was saved for another key or size
+bool render_accumulator_load(render_accumulator_t* self, const char* path);
 
 #endif
\ No newline at end of file
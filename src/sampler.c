@@ -0,0 +1,150 @@
+#include "sampler.h"
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Wellons' lowbias32 integer hash
+static uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t value)
+{
+    return hash_u32(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// Owen scrambling of bit reversed values: flips each bit depending on the bits below it, so points keep
+// the stratification of the sequence while the scrambles of different seeds are independent. A hash in
+// the style of Laine and Karras, whose low bits only depend on lower bits, with Burley's constants
+// ("Practical Hash-based Owen Scrambling"). Working on reversed bits saves reversing them back and forth
+static uint32_t owen_scramble_reversed(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+// The first two dimensions of the Sobol sequence, bit reversed. The first is the van der Corput sequence,
+// which is the index itself. The second's direction numbers are the rows of Pascal's triangle mod 2, so
+// each index bit adds (1 + x)^i as a polynomial over GF(2). Since (1 + x)^(2^k) = 1 + x^(2^k), expanding
+// one bit of i at a time gives it in five branch free steps instead of a loop over the index's bits
+static uint32_t sobol_dimension_0_reversed(uint32_t index)
+{
+    return index;
+}
+
+static uint32_t sobol_dimension_1_reversed(uint32_t index)
+{
+    index ^= (index & 0xaaaaaaaau) >> 1;
+    index ^= (index & 0xccccccccu) >> 2;
+    index ^= (index & 0xf0f0f0f0u) >> 4;
+    index ^= (index & 0xff00ff00u) >> 8;
+    index ^= (index & 0xffff0000u) >> 16;
+    return index;
+}
+
+#define PHILOX_M0 0xd2511f53u
+#define PHILOX_M1 0xcd9e8d57u
+#define PHILOX_W0 0x9e3779b9u
+#define PHILOX_W1 0xbb67ae85u
+#define PHILOX_ROUNDS 10
+
+// Philox 4x32-10 of Salmon et al. ("Parallel Random Numbers: As Easy as 1, 2, 3"): a bijection of the
+// counter, chosen by the key, whose outputs pass BigCrush for consecutive counters
+static void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++)
+    {
+        const uint64_t product0 = (uint64_t) PHILOX_M0 * c0;
+        const uint64_t product1 = (uint64_t) PHILOX_M1 * c2;
+        c0 = (uint32_t) (product1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t) (product0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) product1;
+        c3 = (uint32_t) product0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Philox output for the sampler's next dimension
+static void philox_next(sampler_t* self, uint32_t out[4])
+{
+    const uint32_t counter[4] = {self->pixel, self->index, self->dimension++, 0};
+    const uint32_t key[2] = {self->seed, 0};
+    philox4x32(counter, key, out);
+}
+
+// The top 24 bits, so that the result rounds to a float below 1
+static float fixed_to_unit_float(uint32_t x)
+{
+    return (x >> 8) * 0x1p-24f;
+}
+
+void sampler_start(sampler_t* self, enum sampler_type type, uint32_t seed, uint32_t pixel, uint32_t index)
+{
+    self->type = type;
+    self->seed = seed;
+    self->pixel = pixel;
+    self->index = index;
+    self->dimension = 0;
+    self->scramble_seed = hash_combine(hash_u32(pixel), seed);
+    self->reversed_index = reverse_bits(index);
+}
+
+float sampler_next_1d(sampler_t* self)
+{
+    if (self->type == SAMPLER_PHILOX)
+    {
+        uint32_t bits[4];
+        philox_next(self, bits);
+        return fixed_to_unit_float(bits[0]);
+    }
+
+    // The first of the pair's dimensions, without the cost of the second
+    const uint32_t seed = hash_combine(self->scramble_seed, self->dimension++);
+    const uint32_t index = reverse_bits(owen_scramble_reversed(self->reversed_index, seed));
+    return fixed_to_unit_float(reverse_bits(owen_scramble_reversed(sobol_dimension_0_reversed(index), hash_combine(seed, 0))));
+}
+
+void sampler_next_2d(sampler_t* self, float out[2])
+{
+    if (self->type == SAMPLER_PHILOX)
+    {
+        uint32_t bits[4];
+        philox_next(self, bits);
+        out[0] = fixed_to_unit_float(bits[0]);
+        out[1] = fixed_to_unit_float(bits[1]);
+        return;
+    }
+
+    // Padding: each pair of dimensions visits the pixel's Sobol points in its own scrambled order, so
+    // pairs are stratified on their own but independent of each other
+    const uint32_t seed = hash_combine(self->scramble_seed, self->dimension++);
+    const uint32_t index = reverse_bits(owen_scramble_reversed(self->reversed_index, seed));
+    const uint32_t x = owen_scramble_reversed(sobol_dimension_0_reversed(index), hash_combine(seed, 0));
+    const uint32_t y = owen_scramble_reversed(sobol_dimension_1_reversed(index), hash_combine(seed, 1));
+    out[0] = fixed_to_unit_float(reverse_bits(x));
+    out[1] = fixed_to_unit_float(reverse_bits(y));
+}
@@ -0,0 +1,42 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "common.h"
+
+enum sampler_type
+{
+    // Owen scrambled Sobol points, decorrelated between pairs of dimensions by shuffling their order
+    SAMPLER_SOBOL,
+    // Independent numbers from the Philox 4x32-10 counter based generator, each a hash of the seed, pixel,
+    // sample index and dimension. Nothing is carried from one number to the next, so they can be
+    // evaluated in any order and in parallel
+    SAMPLER_PHILOX
+};
+
+// Hands out the values of one sample of one pixel, a dimension at a time. Every decision a path makes
+// takes the next dimension, so the same decision across the samples of a pixel reads one well stratified
+// sequence. Values only depend on the seed, pixel, sample index and dimension, so renders with the same
+// seed are identical however pixels are split between threads
+typedef struct sampler
+{
+    enum sampler_type type;
+    uint32_t seed;
+    uint32_t pixel;
+    uint32_t index;
+    uint32_t dimension;
+    // Scrambles the pixel's Sobol points
+    uint32_t scramble_seed;
+    // The sample index, bit reversed for scrambling
+    uint32_t reversed_index;
+} sampler_t;
+
+// Starts sample index of the pixel at the given index into the image
+void sampler_start(sampler_t* self, enum sampler_type type, uint32_t seed, uint32_t pixel, uint32_t index);
+
+// A value in [0, 1). Takes a whole pair of dimensions, like sampler_next_2d
+float sampler_next_1d(sampler_t* self);
+
+// Two values in [0, 1) that are stratified together over the pixel's samples
+void sampler_next_2d(sampler_t* self, float out[2]);
+
+#endif
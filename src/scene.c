@@ -1,16 +1,31 @@
 #include "scene.h"
 
 #include <assert.h>
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
 #include <float.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include "utils.h"
 #include "ray.h"
 #include "texture.h"
 #include "material.h"
 
-#ifdef USE_BVH
-    #define BUILD_BVH_TREE(scene) scene_build_bvh_node(scene, 0, scene->num_objects-1)
+#ifdef BVH_STATS
+static atomic_uint_fast64_t bvh_stats_rays;
+static atomic_uint_fast64_t bvh_stats_nodes_visited;
+
+#define BVH_STATS_RECORD(nodes_visited) \
+do { \
+    atomic_fetch_add_explicit(&bvh_stats_rays, 1, memory_order_relaxed); \
+    atomic_fetch_add_explicit(&bvh_stats_nodes_visited, (nodes_visited), memory_order_relaxed); \
+} while (0)
 #else
-    #define BUILD_BVH_TREE(scene)
+#define BVH_STATS_RECORD(nodes_visited) ((void) (nodes_visited))
 #endif
 
 static void ray_hit_set_normal(const ray_t* ray, const vec3_t n, ray_hit_t* out)
@@ -19,18 +34,17 @@ static void ray_hit_set_normal(const ray_t* ray, const vec3_t n, ray_hit_t* out)
     vec3_normalize(n, out->normal);
     if (!out->front_face)
     {
-        vec3_negate(n, out->normal);
+        vec3_negate(out->normal, out->normal);
     }
 }
 
-static bool sphere_intersect_ray(const scene_object_t* self, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+static bool sphere_ray_distance_sq(const vec3_t center, float radius_sq, const ray_t* ray, float tmin, float tmax, float* out_t)
 {
-    const sphere_t* sphere = &self->underlying.sphere;
     vec3_t c_vec;
-    vec3_sub(ray->begin, sphere->center, c_vec);
+    vec3_sub(ray->begin, center, c_vec);
     float a = 1.0f;
     float b = 2.0f * vec3_dot(ray->dir, c_vec);
-    float c = vec3_norm_sq(c_vec) - sphere->radius * sphere->radius;
+    float c = vec3_norm_sq(c_vec) - radius_sq;
     float discriminant = b * b - 4 * a * c;
 
     if (discriminant < 0.0f) return false;
@@ -40,17 +54,28 @@ static bool sphere_intersect_ray(const scene_object_t* self, const ray_t* ray, f
 
     if (t1 >= tmin && t1 <= tmax)
     {
-        out->t = t1;
+        *out_t = t1;
     }
     else if (t2 >= tmin && t2 <= tmax)
     {
-        out->t = t2;
+        *out_t = t2;
     }
     else
     {
         return false;
     }
+    return true;
+}
+
+static bool sphere_ray_distance(const sphere_t* sphere, const ray_t* ray, float tmin, float tmax, float* out_t)
+{
+    return sphere_ray_distance_sq(sphere->center, sphere->radius * sphere->radius, ray, tmin, tmax, out_t);
+}
 
+// Fills in the rest of the hit record once out->t is known to be the closest hit
+static void sphere_set_hit(const scene_object_t* self, const ray_t* ray, ray_hit_t* out)
+{
+    const sphere_t* sphere = &self->underlying.sphere;
     vec3_t n;
     vec3_mult(ray->dir, out->t, out->position);
     vec3_add(out->position, ray->begin, out->position);
@@ -58,14 +83,10 @@ static bool sphere_intersect_ray(const scene_object_t* self, const ray_t* ray, f
     out->material = self->material;
     
     ray_hit_set_normal(ray, n, out);
-
-    return true;
 }
 
-static bool quad_intersect_ray(const scene_object_t* self, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+static bool quad_ray_distance(const quad_t* quad, const ray_t* ray, float tmin, float tmax, float* out_t)
 {
-    const quad_t* quad = &self->underlying.quad;
-
     const float denom = vec3_dot(quad->normal, ray->dir);
 
     vec3_t diff, pos, p, v1, v2;
@@ -93,50 +114,77 @@ static bool quad_intersect_ray(const scene_object_t* self, const ray_t* ray, flo
 
     if (alpha >= 0 && alpha <= 1 && beta >= 0 && beta <= 1)
     {
-        vec3_copy(pos, out->position);
-        out->t = t;
-        out->material = self->material;
-        ray_hit_set_normal(ray, quad->normal, out);
+        *out_t = t;
         return true;
     }
     return false;
 }
 
-#ifdef USE_BVH
-static void aabb_merge(const aabb_t* a1, const aabb_t* a2, aabb_t* out)
+static void quad_set_hit(const scene_object_t* self, const ray_t* ray, ray_hit_t* out)
 {
-    vec3_min(a1->min, a2->min, out->min);
-    vec3_max(a1->max, a2->max, out->max);
+    vec3_mult(ray->dir, out->t, out->position);
+    vec3_add(out->position, ray->begin, out->position);
+    out->material = self->material;
+    ray_hit_set_normal(ray, self->underlying.quad.normal, out);
 }
 
-static void aabb_copy(const aabb_t* src, aabb_t* dst)
+// Möller–Trumbore: solves for the distance and two barycentric coordinates of the hit at once, with no
+// plane intersection and inside test as for quads. e1 and e2 are the edges from v0 to v1 and v2
+static bool triangle_edges_ray_distance(const vec3_t v0, const vec3_t e1, const vec3_t e2, const ray_t* ray, float tmin, float tmax, float* out_t)
 {
-    memcpy(dst, src, sizeof(aabb_t));
+    vec3_t p, s, q;
+    vec3_cross(ray->dir, e2, p);
+    // Positive when the ray hits the front, since det = -dot(dir, cross(e1, e2))
+    const float det = vec3_dot(e1, p);
+
+#ifdef BACKFACE_CULL
+    if (det <= 0.0f) return false;
+#endif
+    if (det == 0.0f) return false;
+    const float inv_det = 1.0f / det;
+
+    vec3_sub(ray->begin, v0, s);
+    const float u = vec3_dot(s, p) * inv_det;
+    if (u < 0.0f || u > 1.0f) return false;
+
+    vec3_cross(s, e1, q);
+    const float v = vec3_dot(ray->dir, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    const float t = vec3_dot(e2, q) * inv_det;
+    if (t < tmin || t > tmax) return false;
+
+    *out_t = t;
+    return true;
 }
 
-enum axis aabb_largest_axis(const aabb_t* a)
+static bool triangle_ray_distance(const triangle_t* triangle, const ray_t* ray, float tmin, float tmax, float* out_t)
 {
-    vec3_t axis_lengths;
-    vec3_sub(a->max, a->min, axis_lengths);
-    if (axis_lengths[0] >= axis_lengths[1])
-    {
-        if (axis_lengths[0] >= axis_lengths[2]) return AXIS_X;
-        else return AXIS_Z;
-    }
-    else
-    {
-        if (axis_lengths[1] >= axis_lengths[2]) return AXIS_Y;
-        else return AXIS_Z;
-    }
+    const float *v0, *v1, *v2;
+    mesh_triangle_vertices(triangle->mesh, triangle->index, &v0, &v1, &v2);
+    vec3_t e1, e2;
+    vec3_sub(v1, v0, e1);
+    vec3_sub(v2, v0, e2);
+    return triangle_edges_ray_distance(v0, e1, e2, ray, tmin, tmax, out_t);
 }
 
-static void aabb_pad(aabb_t* aabb)
+static void triangle_set_hit(const scene_object_t* self, const ray_t* ray, ray_hit_t* out)
 {
-    static const vec3_t pad = {0.0001f, 0.0001f, 0.0001f};
-    vec3_sub(aabb->min, pad, aabb->min);
-    vec3_add(aabb->max, pad, aabb->max);
+    const triangle_t* triangle = &self->underlying.triangle;
+    const float *v0, *v1, *v2;
+    mesh_triangle_vertices(triangle->mesh, triangle->index, &v0, &v1, &v2);
+    vec3_t e1, e2, n;
+    vec3_sub(v1, v0, e1);
+    vec3_sub(v2, v0, e2);
+    vec3_cross(e1, e2, n);
+
+    vec3_mult(ray->dir, out->t, out->position);
+    vec3_add(out->position, ray->begin, out->position);
+    out->material = self->material;
+    ray_hit_set_normal(ray, n, out);
 }
 
+#ifdef USE_BVH
 static void scene_object_sphere_aabb(const sphere_t* sphere, aabb_t* out)
 {
     vec3_t diff;
@@ -162,6 +210,62 @@ static void scene_object_quad_aabb(const quad_t* quad, aabb_t* out)
     vec3_max(out->max, c4, out->max);
     aabb_pad(out);
 }
+
+static void scene_object_triangle_aabb(const triangle_t* triangle, aabb_t* out)
+{
+    const float *v0, *v1, *v2;
+    mesh_triangle_vertices(triangle->mesh, triangle->index, &v0, &v1, &v2);
+    aabb_empty(out);
+    aabb_grow(out, v0);
+    aabb_grow(out, v1);
+    aabb_grow(out, v2);
+    aabb_pad(out);
+}
+
+static void scene_object_instance_aabb(const instance_t* instance, aabb_t* out)
+{
+    const aabb_t* bounds = &instance->geometry->bvh.nodes[0].aabb;
+    aabb_empty(out);
+    mat34_t object_to_world;
+    if (!mat34_inverse(&instance->world_to_object, &object_to_world))
+    {
+        // world_to_object is itself an inverse, so this only fails if it was set without one
+        assert(false);
+        return;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        const vec3_t corner = {
+            (i & 1) ? bounds->max[0] : bounds->min[0],
+            (i & 2) ? bounds->max[1] : bounds->min[1],
+            (i & 4) ? bounds->max[2] : bounds->min[2]
+        };
+        vec3_t p;
+        mat34_transform_point(&object_to_world, corner, p);
+        aabb_grow(out, p);
+    }
+}
+
+static void scene_object_update_aabb(scene_object_t* self)
+{
+    switch (self->type)
+    {
+        case OBJECT_SPHERE:
+            scene_object_sphere_aabb(&self->underlying.sphere, &self->aabb);
+            break;
+        case OBJECT_QUAD:
+            scene_object_quad_aabb(&self->underlying.quad, &self->aabb);
+            break;
+        case OBJECT_TRIANGLE:
+            scene_object_triangle_aabb(&self->underlying.triangle, &self->aabb);
+            break;
+        case OBJECT_INSTANCE:
+            scene_object_instance_aabb(&self->underlying.instance, &self->aabb);
+            break;
+        default:
+            assert(false);
+    }
+}
 #endif
 
 static void scene_object_sphere_init(scene_object_t* self, material_t* material, const vec3_t center, float radius)
@@ -169,6 +273,7 @@ static void scene_object_sphere_init(scene_object_t* self, material_t* material,
     sphere_t* sphere = &self->underlying.sphere;
     self->type = OBJECT_SPHERE;
     self->material = material_acquire(material);
+    self->light_pdf = 0.0f;
     vec3_copy(center, sphere->center);
     sphere->radius = radius;
 #ifdef USE_BVH
@@ -181,6 +286,7 @@ static void scene_object_quad_init(scene_object_t* self, material_t* material, c
     quad_t* quad = &self->underlying.quad;
     self->type = OBJECT_QUAD;
     self->material = material_acquire(material);
+    self->light_pdf = 0.0f;
     vec3_copy(origin, quad->origin);
     vec3_copy(u, quad->u);
     vec3_copy(v, quad->v);
@@ -193,6 +299,35 @@ static void scene_object_quad_init(scene_object_t* self, material_t* material, c
 #endif
 }
 
+static void scene_object_triangle_init(scene_object_t* self, material_t* material, mesh_t* mesh, uint32_t index)
+{
+    triangle_t* triangle = &self->underlying.triangle;
+    self->type = OBJECT_TRIANGLE;
+    self->material = material_acquire(material);
+    self->light_pdf = 0.0f;
+    triangle->mesh = mesh_acquire(mesh);
+    triangle->index = index;
+#ifdef USE_BVH
+    scene_object_triangle_aabb(triangle, &self->aabb);
+#endif
+}
+
+static void scene_object_instance_init(scene_object_t* self, geometry_t* geometry, const mat34_t* object_to_world)
+{
+    instance_t* instance = &self->underlying.instance;
+    self->type = OBJECT_INSTANCE;
+    self->material = NULL;
+    self->light_pdf = 0.0f;
+    const bool invertible = mat34_inverse(object_to_world, &instance->world_to_object);
+    assert(invertible);
+    (void) invertible;
+    instance->geometry = geometry_acquire(geometry);
+#ifdef USE_BVH
+    assert(geometry->bvh.num_nodes > 0);
+    scene_object_instance_aabb(instance, &self->aabb);
+#endif
+}
+
 static bool sphere_intersect_sphere(const sphere_t* a, const sphere_t* b)
 {
     vec3_t diff;
@@ -225,21 +360,42 @@ static bool sphere_intersect_scene(const sphere_t* sphere, const scene_t* scene)
     return false;
 }
 
+// Grows an object array to hold at least capacity objects
+static void objects_reserve(scene_object_t** objects, size_t* capacity, size_t new_capacity)
+{
+    if (new_capacity <= *capacity) return;
+    *objects = realloc(*objects, sizeof(scene_object_t) * new_capacity);
+    assert(*objects);
+    *capacity = new_capacity;
+}
+
+// Appends an uninitialized object, doubling the array when it is full. Pointers to earlier objects are
+// invalidated if it grows
+static scene_object_t* objects_push(scene_object_t** objects, size_t* num_objects, size_t* capacity)
+{
+    if (*num_objects == *capacity)
+    {
+        objects_reserve(objects, capacity, *capacity ? *capacity * 2 : 8);
+    }
+    return &(*objects)[(*num_objects)++];
+}
+
+static scene_object_t* scene_push_object(scene_t* self)
+{
+    return objects_push(&self->objects, &self->num_objects, &self->capacity);
+}
+
 static const scene_object_t* scene_add_sphere(scene_t* self, material_t* material, const vec3_t center, float radius)
 {
-    assert(self->num_objects < MAX_OBJECTS);
-    scene_object_t* object = &self->objects[self->num_objects];
+    scene_object_t* object = scene_push_object(self);
     scene_object_sphere_init(object, material, center, radius);
-    self->num_objects++;
     return object;
 }
 
 static const scene_object_t* scene_add_quad(scene_t* self, material_t* material, const vec3_t origin, const vec3_t u, const vec3_t v)
 {
-    assert(self->num_objects < MAX_OBJECTS);
-    scene_object_t* object = &self->objects[self->num_objects];
+    scene_object_t* object = scene_push_object(self);
     scene_object_quad_init(object, material, origin, u, v);
-    self->num_objects++;
     return object;
 }
 
@@ -287,212 +443,1377 @@ static bool try_place_random_sphere_on_sphere(scene_t* self, const sphere_t* sur
     return true;
 }
 
-static bool ray_intersect_aabb(const ray_t* ray, const aabb_t* aabb, float tmin, float tmax)
-{ 
-    vec3_t reciprocal_dir;
-    vec3_reciprocal(ray->dir, reciprocal_dir);
-    const float tx1 = (aabb->min[0] - ray->begin[0]) * reciprocal_dir[0];
-    const float tx2 = (aabb->max[0] - ray->begin[0]) * reciprocal_dir[0];
+static bool ray_intersect_geometry(const ray_t* ray, const geometry_t* geometry, float tmin, float tmax, ray_hit_t* out);
 
-    tmin = fmaxf(tmin, fminf(tx1, tx2));
-    tmax = fminf(tmax, fmaxf(tx1, tx2));
+static bool ray_occluded_geometry(const ray_t* ray, const geometry_t* geometry, float tmin, float tmax);
 
-    const float ty1 = (aabb->min[1] - ray->begin[1]) * reciprocal_dir[1];
-    const float ty2 = (aabb->max[1] - ray->begin[1]) * reciprocal_dir[1];
+// Moves the ray into object space. The direction is renormalized since the primitive tests assume unit
+// directions, so distances along the local ray are the world distances multiplied by out_scale
+static void instance_transform_ray(const instance_t* instance, const ray_t* ray, ray_t* out, float* out_scale)
+{
+    mat34_transform_point(&instance->world_to_object, ray->begin, out->begin);
+    mat34_transform_dir(&instance->world_to_object, ray->dir, out->dir);
+    *out_scale = vec3_norm(out->dir);
+    vec3_div(out->dir, *out_scale, out->dir);
+}
+
+// Moves a hit on the instance's geometry back into world space, where scale is from instance_transform_ray
+static void instance_set_hit(const instance_t* instance, const ray_t* ray, float scale, ray_hit_t* out)
+{
+    out->t /= scale;
+    vec3_mult(ray->dir, out->t, out->position);
+    vec3_add(out->position, ray->begin, out->position);
 
-    tmin = fmaxf(fminf(ty1, ty2), tmin);
-    tmax = fminf(fmaxf(ty1, ty2), tmax);
+    // Normals go through the inverse transpose. The local normal already faces against the local ray,
+    // and the transform preserves that, so front_face carries over
+    mat34_transpose_transform_dir(&instance->world_to_object, out->normal, out->normal);
+    vec3_normalize(out->normal, out->normal);
+}
 
-    const float tz1 = (aabb->min[2] - ray->begin[2]) * reciprocal_dir[2];
-    const float tz2 = (aabb->max[2] - ray->begin[2]) * reciprocal_dir[2];
+static bool instance_intersect_ray(const scene_object_t* self, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+{
+    const instance_t* instance = &self->underlying.instance;
+    ray_t local_ray;
+    float scale;
+    instance_transform_ray(instance, ray, &local_ray, &scale);
+    if (!ray_intersect_geometry(&local_ray, instance->geometry, tmin * scale, tmax * scale, out)) return false;
 
-    tmin = fmaxf(fminf(tz1, tz2), tmin);
-    tmax = fminf(fmaxf(tz1, tz2), tmax);
+    instance_set_hit(instance, ray, scale, out);
+    return true;
+}
 
-    return tmin <= tmax;
+static bool instance_occludes_ray(const scene_object_t* self, const ray_t* ray, float tmin, float tmax)
+{
+    const instance_t* instance = &self->underlying.instance;
+    ray_t local_ray;
+    float scale;
+    instance_transform_ray(instance, ray, &local_ray, &scale);
+    return ray_occluded_geometry(&local_ray, instance->geometry, tmin * scale, tmax * scale);
 }
 
-static bool ray_intersect_scene_object(const ray_t* ray, const scene_object_t* object, float tmin, float tmax, ray_hit_t* out)
+static bool scene_object_ray_distance(const ray_t* ray, const scene_object_t* object, float tmin, float tmax, float* out_t)
 {
     switch (object->type)
     {
         case OBJECT_SPHERE:
-            return sphere_intersect_ray(object, ray, tmin, tmax, out);
+            return sphere_ray_distance(&object->underlying.sphere, ray, tmin, tmax, out_t);
         case OBJECT_QUAD:
-            return quad_intersect_ray(object, ray, tmin, tmax, out);
+            return quad_ray_distance(&object->underlying.quad, ray, tmin, tmax, out_t);
+        case OBJECT_TRIANGLE:
+            return triangle_ray_distance(&object->underlying.triangle, ray, tmin, tmax, out_t);
         default:
             assert(false);
             return false;
     }
 }
 
+static void scene_object_set_hit(const scene_object_t* object, const ray_t* ray, ray_hit_t* out)
+{
+    switch (object->type)
+    {
+        case OBJECT_SPHERE:
+            sphere_set_hit(object, ray, out);
+            break;
+        case OBJECT_QUAD:
+            quad_set_hit(object, ray, out);
+            break;
+        case OBJECT_TRIANGLE:
+            triangle_set_hit(object, ray, out);
+            break;
+        default:
+            assert(false);
+    }
+    out->object = object;
+}
+
+#ifndef USE_BVH
+static bool scene_object_occludes_ray(const ray_t* ray, const scene_object_t* object, float tmin, float tmax)
+{
+    float t;
+    if (object->type == OBJECT_INSTANCE) return instance_occludes_ray(object, ray, tmin, tmax);
+    return scene_object_ray_distance(ray, object, tmin, tmax, &t);
+}
+#endif
+
+// Closest hit found so far in a traversal. Primitives only record their object and distance, and the
+// hit record is filled in once for the final one. Instances fill it in as they are hit, since their
+// local ray is gone by the end, and leave object NULL
+struct closest_hit
+{
+    const scene_object_t* object;
+    float t;
+    bool found;
+};
+
+static void closest_hit_record(struct closest_hit* closest, const scene_object_t* object, float t)
+{
+    closest->object = object;
+    closest->t = t;
+    closest->found = true;
+}
+
+static void ray_intersect_object_closest(const ray_t* ray, const scene_object_t* object, float tmin, struct closest_hit* closest, ray_hit_t* out)
+{
+    float t;
+    if (object->type == OBJECT_INSTANCE)
+    {
+        if (instance_intersect_ray(object, ray, tmin, closest->t, out)) closest_hit_record(closest, NULL, out->t);
+    }
+    else if (scene_object_ray_distance(ray, object, tmin, closest->t, &t))
+    {
+        closest_hit_record(closest, object, t);
+    }
+}
+
+static bool closest_hit_finish(const struct closest_hit* closest, const ray_t* ray, ray_hit_t* out)
+{
+    if (closest->object)
+    {
+        out->t = closest->t;
+        scene_object_set_hit(closest->object, ray, out);
+    }
+    return closest->found;
+}
+
 #ifdef USE_BVH
-static bool ray_intersect_bvh(const scene_t* scene, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+// Spheres and quads transposed so that lane i of each field belongs to one object, for testing a block
+// of them in one pass. Unused sphere lanes have a radius_sq of -infinity and unused quad lanes a zero
+// normal, which both always miss
+struct sphere_packet
 {
-    //static __thread uint16_t stack[128];
-    uint16_t stack[128];
+    _Alignas(16) float center[3][LEAF_PACKET_WIDTH];
+    float radius_sq[LEAF_PACKET_WIDTH];
+};
 
-    uint16_t stack_len = 0;
-    stack[stack_len++] = 0;
-    bool success = false;
+struct quad_packet
+{
+    _Alignas(16) float origin[3][LEAF_PACKET_WIDTH];
+    float u[3][LEAF_PACKET_WIDTH];
+    float v[3][LEAF_PACKET_WIDTH];
+    float normal[3][LEAF_PACKET_WIDTH];
+    float w[3][LEAF_PACKET_WIDTH];
+};
+
+// Vertices copied out of the mesh, with the edges the intersection test needs precomputed
+struct triangle_prim
+{
+    vec3_t v0;
+    vec3_t e1;
+    vec3_t e2;
+};
 
-    while (stack_len > 0)
+// A leaf's range in each per-type array. Sphere and quad ranges are counted in packets
+struct leaf_ranges
+{
+    uint32_t first_sphere_packet;
+    uint32_t num_sphere_packets;
+    uint32_t first_quad_packet;
+    uint32_t num_quad_packets;
+    uint32_t first_triangle;
+    uint32_t num_triangles;
+    uint32_t first_instance;
+    uint32_t num_instances;
+};
+
+#define LEAF_PACKETS(count) (((count) + LEAF_PACKET_WIDTH - 1) / LEAF_PACKET_WIDTH)
+
+static void leaf_prims_init(leaf_prims_t* self)
+{
+    memset(self, 0, sizeof(leaf_prims_t));
+}
+
+static void leaf_prims_destroy(leaf_prims_t* self)
+{
+    free(self->leaf_indices);
+    free(self->leaves);
+    free(self->sphere_packets);
+    free(self->quad_packets);
+    free(self->triangles);
+    free(self->sphere_objects);
+    free(self->quad_objects);
+    free(self->triangle_objects);
+    free(self->instance_objects);
+    leaf_prims_init(self);
+}
+
+static void sphere_packet_set_lane(struct sphere_packet* self, int lane, const sphere_t* sphere)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        self->center[axis][lane] = sphere->center[axis];
+    }
+    self->radius_sq[lane] = sphere->radius * sphere->radius;
+}
+
+static void quad_packet_set_lane(struct quad_packet* self, int lane, const quad_t* quad)
+{
+    for (int axis = 0; axis < 3; axis++)
     {
-        const uint16_t node_index = stack[--stack_len];
-        const bvh_node_t* node = &scene->bvh_nodes[node_index];
+        self->origin[axis][lane] = quad->origin[axis];
+        self->u[axis][lane] = quad->u[axis];
+        self->v[axis][lane] = quad->v[axis];
+        self->normal[axis][lane] = quad->normal[axis];
+        self->w[axis][lane] = quad->w[axis];
+    }
+}
+
+static void triangle_prim_init(struct triangle_prim* self, const triangle_t* triangle)
+{
+    const float *v0, *v1, *v2;
+    mesh_triangle_vertices(triangle->mesh, triangle->index, &v0, &v1, &v2);
+    vec3_copy(v0, self->v0);
+    vec3_sub(v1, v0, self->e1);
+    vec3_sub(v2, v0, self->e2);
+}
+
+// Copies the objects of every leaf into the per-type arrays. Must be redone whenever the BVH is rebuilt,
+// since leaves are found by their offset into prim_indices. Instances are referenced rather than copied,
+// so moving one only needs a refit
+static void leaf_prims_build(leaf_prims_t* self, const scene_object_t* objects, const bvh_t* bvh)
+{
+    leaf_prims_destroy(self);
 
-        if (!ray_intersect_aabb(ray, &node->aabb, tmin, tmax)) continue;
+    // Leaf 0 is empty, for the offsets that start no leaf
+    size_t num_leaves = 1;
+    struct leaf_ranges totals = {0};
+    for (size_t i = 0; i < bvh->num_nodes; i++)
+    {
+        const bvh_node_t* node = &bvh->nodes[i];
+        const uint32_t count = bvh_node_count(node);
+        if (!bvh_node_is_leaf(node) || count == 0) continue;
 
-        if (node->is_leaf)
+        uint32_t num_spheres = 0, num_quads = 0;
+        for (uint32_t j = node->offset; j < node->offset + count; j++)
         {
-            const uint16_t object_index = node->underlying.leaf.index;
-            if (ray_intersect_scene_object(ray, &scene->objects[object_index], tmin, tmax, out))
+            switch (objects[bvh->prim_indices[j]].type)
             {
-                tmax = fminf(out->t, tmax);
-                success = true;
+                case OBJECT_SPHERE:
+                    num_spheres++;
+                    break;
+                case OBJECT_QUAD:
+                    num_quads++;
+                    break;
+                case OBJECT_TRIANGLE:
+                    totals.num_triangles++;
+                    break;
+                case OBJECT_INSTANCE:
+                    totals.num_instances++;
+                    break;
             }
-            continue;
         }
+        totals.num_sphere_packets += LEAF_PACKETS(num_spheres);
+        totals.num_quad_packets += LEAF_PACKETS(num_quads);
+        num_leaves++;
+    }
 
-        const uint16_t left_index = node->underlying.children.left;
-        const uint16_t right_index = node->underlying.children.right;
-        stack[stack_len++] = right_index;
-        stack[stack_len++] = left_index;
+    self->leaf_indices = calloc(bvh->num_prim_indices + 1, sizeof(uint32_t));
+    self->leaves = calloc(num_leaves, sizeof(struct leaf_ranges));
+    self->sphere_packets = aligned_alloc(_Alignof(struct sphere_packet), sizeof(struct sphere_packet) * totals.num_sphere_packets);
+    self->quad_packets = aligned_alloc(_Alignof(struct quad_packet), sizeof(struct quad_packet) * totals.num_quad_packets);
+    self->triangles = malloc(sizeof(struct triangle_prim) * totals.num_triangles);
+    self->sphere_objects = malloc(sizeof(uint32_t) * LEAF_PACKET_WIDTH * totals.num_sphere_packets);
+    self->quad_objects = malloc(sizeof(uint32_t) * LEAF_PACKET_WIDTH * totals.num_quad_packets);
+    self->triangle_objects = malloc(sizeof(uint32_t) * totals.num_triangles);
+    self->instance_objects = malloc(sizeof(uint32_t) * totals.num_instances);
+    self->num_leaves = num_leaves;
+    self->num_sphere_packets = totals.num_sphere_packets;
+    self->num_quad_packets = totals.num_quad_packets;
+    self->num_triangles = totals.num_triangles;
+    self->num_instances = totals.num_instances;
+
+    for (uint32_t i = 0; i < totals.num_sphere_packets; i++)
+    {
+        memset(&self->sphere_packets[i], 0, sizeof(struct sphere_packet));
+        for (int lane = 0; lane < LEAF_PACKET_WIDTH; lane++)
+        {
+            self->sphere_packets[i].radius_sq[lane] = -INFINITY;
+            self->sphere_objects[i * LEAF_PACKET_WIDTH + lane] = UINT32_MAX;
+        }
+    }
+    for (uint32_t i = 0; i < totals.num_quad_packets; i++)
+    {
+        memset(&self->quad_packets[i], 0, sizeof(struct quad_packet));
+        for (int lane = 0; lane < LEAF_PACKET_WIDTH; lane++)
+        {
+            self->quad_objects[i * LEAF_PACKET_WIDTH + lane] = UINT32_MAX;
+        }
     }
-    return success;
-}
-#endif
 
-static bool ray_intersect_no_bvh(const scene_t* self, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
-{
-    bool success = false;
-    for (size_t i = 0; i < self->num_objects; i++)
+    struct leaf_ranges next = {0};
+    num_leaves = 1;
+    for (size_t i = 0; i < bvh->num_nodes; i++)
     {
-        if (ray_intersect_scene_object(ray, &self->objects[i], tmin, tmax, out))
+        const bvh_node_t* node = &bvh->nodes[i];
+        const uint32_t count = bvh_node_count(node);
+        if (!bvh_node_is_leaf(node) || count == 0) continue;
+
+        uint32_t num_spheres = 0, num_quads = 0;
+        struct leaf_ranges* leaf = &self->leaves[num_leaves];
+        leaf->first_sphere_packet = next.num_sphere_packets;
+        leaf->first_quad_packet = next.num_quad_packets;
+        leaf->first_triangle = next.num_triangles;
+        leaf->first_instance = next.num_instances;
+        for (uint32_t j = node->offset; j < node->offset + count; j++)
         {
-            success = true;
-            tmax = fminf(tmax, out->t);
+            const uint32_t index = bvh->prim_indices[j];
+            const scene_object_t* object = &objects[index];
+            uint32_t slot;
+            switch (object->type)
+            {
+                case OBJECT_SPHERE:
+                    slot = leaf->first_sphere_packet * LEAF_PACKET_WIDTH + num_spheres++;
+                    sphere_packet_set_lane(&self->sphere_packets[slot / LEAF_PACKET_WIDTH], slot % LEAF_PACKET_WIDTH, &object->underlying.sphere);
+                    self->sphere_objects[slot] = index;
+                    break;
+                case OBJECT_QUAD:
+                    slot = leaf->first_quad_packet * LEAF_PACKET_WIDTH + num_quads++;
+                    quad_packet_set_lane(&self->quad_packets[slot / LEAF_PACKET_WIDTH], slot % LEAF_PACKET_WIDTH, &object->underlying.quad);
+                    self->quad_objects[slot] = index;
+                    break;
+                case OBJECT_TRIANGLE:
+                    slot = leaf->first_triangle + leaf->num_triangles++;
+                    triangle_prim_init(&self->triangles[slot], &object->underlying.triangle);
+                    self->triangle_objects[slot] = index;
+                    break;
+                case OBJECT_INSTANCE:
+                    self->instance_objects[leaf->first_instance + leaf->num_instances++] = index;
+                    break;
+            }
         }
+        leaf->num_sphere_packets = LEAF_PACKETS(num_spheres);
+        leaf->num_quad_packets = LEAF_PACKETS(num_quads);
+        next.num_sphere_packets += leaf->num_sphere_packets;
+        next.num_quad_packets += leaf->num_quad_packets;
+        next.num_triangles += leaf->num_triangles;
+        next.num_instances += leaf->num_instances;
+        self->leaf_indices[node->offset] = num_leaves++;
     }
-    return success;
 }
 
-static void scene_object_destroy(scene_object_t* self)
+// Copies the objects' current shapes into the lanes they already occupy, after a BVH refit that moved
+// objects without changing the tree, and so without changing which lane each object is in
+static void leaf_prims_update(leaf_prims_t* self, const scene_object_t* objects)
 {
-    material_release(self->material);
+    for (size_t slot = 0; slot < self->num_sphere_packets * LEAF_PACKET_WIDTH; slot++)
+    {
+        const uint32_t index = self->sphere_objects[slot];
+        if (index == UINT32_MAX) continue;
+        sphere_packet_set_lane(&self->sphere_packets[slot / LEAF_PACKET_WIDTH], slot % LEAF_PACKET_WIDTH, &objects[index].underlying.sphere);
+    }
+    for (size_t slot = 0; slot < self->num_quad_packets * LEAF_PACKET_WIDTH; slot++)
+    {
+        const uint32_t index = self->quad_objects[slot];
+        if (index == UINT32_MAX) continue;
+        quad_packet_set_lane(&self->quad_packets[slot / LEAF_PACKET_WIDTH], slot % LEAF_PACKET_WIDTH, &objects[index].underlying.quad);
+    }
+    for (size_t slot = 0; slot < self->num_triangles; slot++)
+    {
+        triangle_prim_init(&self->triangles[slot], &objects[self->triangle_objects[slot]].underlying.triangle);
+    }
 }
 
-#ifdef USE_BVH
-static int box_x_compare(const void* a, const void* b)
+#ifdef __SSE2__
+static inline __m128 packet_dot(const __m128 a[3], const __m128 b[3])
 {
-    const float v1 = ((scene_object_t*)a)->aabb.min[0];
-    const float v2 = ((scene_object_t*)b)->aabb.min[0];
-    if (v1 < v2) return -1;
-    if (v2 > v1) return 1;
-    return 0; 
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
 }
 
-static int box_y_compare(const void* a, const void* b)
+static inline __m128 packet_select(__m128 mask, __m128 a, __m128 b)
 {
-    const float v1 = ((scene_object_t*)a)->aabb.min[1];
-    const float v2 = ((scene_object_t*)b)->aabb.min[1];
-    if (v1 < v2) return -1;
-    if (v2 > v1) return 1;
-    return 0;
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
 }
 
-static int box_z_compare(const void* a, const void* b)
+static inline void packet_load(const float field[3][LEAF_PACKET_WIDTH], __m128 out[3])
 {
-    const float v1 = ((scene_object_t*)a)->aabb.min[2];
-    const float v2 = ((scene_object_t*)b)->aabb.min[2];
-    if (v1 < v2) return -1;
-    if (v2 > v1) return 1;
-    return 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        out[axis] = _mm_load_ps(field[axis]);
+    }
 }
 
-static uint16_t scene_build_bvh_node(scene_t* self, uint16_t start, uint16_t end)
+// Returns the lane with the smallest finite distance in t, or -1 if there is none. Ties go to the last
+// lane, as the scalar loop lets later objects at an equal distance replace earlier ones
+static int packet_nearest_lane(__m128 t, float* out_t)
 {
-    typedef int (*comparator)(const void*, const void*);
+    __m128 min = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+    min = _mm_min_ps(min, _mm_shuffle_ps(min, min, _MM_SHUFFLE(1, 0, 3, 2)));
+    const int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpeq_ps(t, min), _mm_cmplt_ps(t, _mm_set1_ps(INFINITY))));
+    if (!mask) return -1;
+    *out_t = _mm_cvtss_f32(min);
+    return 31 - __builtin_clz(mask);
+}
+#endif
 
-    static const comparator comparators[3] = {box_x_compare, box_y_compare, box_z_compare};
+// sphere_ray_distance on every lane, returning the lane of the nearest hit or -1. The vector path repeats
+// the scalar operations in the same order, so distances match the scalar test exactly
+static int sphere_packet_intersect(const struct sphere_packet* packet, const ray_t* ray, float tmin, float tmax, float* out_t)
+{
+#ifdef __SSE2__
+    const __m128 dir[3] = {_mm_set1_ps(ray->dir[0]), _mm_set1_ps(ray->dir[1]), _mm_set1_ps(ray->dir[2])};
+    __m128 c_vec[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        c_vec[axis] = _mm_sub_ps(_mm_set1_ps(ray->begin[axis]), _mm_load_ps(packet->center[axis]));
+    }
+    const __m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), packet_dot(dir, c_vec));
+    const __m128 c = _mm_sub_ps(packet_dot(c_vec, c_vec), _mm_load_ps(packet->radius_sq));
+    const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4.0f), c));
+
+    const __m128 root = _mm_sqrt_ps(discriminant);
+    const __m128 neg_b = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 t1 = _mm_div_ps(_mm_sub_ps(neg_b, root), two);
+    const __m128 t2 = _mm_div_ps(_mm_add_ps(neg_b, root), two);
+
+    const __m128 vmin = _mm_set1_ps(tmin);
+    const __m128 vmax = _mm_set1_ps(tmax);
+    const __m128 t1_in_range = _mm_and_ps(_mm_cmpge_ps(t1, vmin), _mm_cmple_ps(t1, vmax));
+    const __m128 t2_in_range = _mm_and_ps(_mm_cmpge_ps(t2, vmin), _mm_cmple_ps(t2, vmax));
+    const __m128 hit = _mm_and_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()), _mm_or_ps(t1_in_range, t2_in_range));
+    const __m128 t = packet_select(t1_in_range, t1, t2);
+    return packet_nearest_lane(packet_select(hit, t, _mm_set1_ps(INFINITY)), out_t);
+#else
+    int nearest = -1;
+    for (int lane = 0; lane < LEAF_PACKET_WIDTH; lane++)
+    {
+        const vec3_t center = {packet->center[0][lane], packet->center[1][lane], packet->center[2][lane]};
+        if (sphere_ray_distance_sq(center, packet->radius_sq[lane], ray, tmin, tmax, out_t))
+        {
+            tmax = *out_t;
+            nearest = lane;
+        }
+    }
+    return nearest;
+#endif
+}
 
-    const uint16_t node_index = self->num_nodes++;
-    bvh_node_t* node = &self->bvh_nodes[node_index];
+// quad_ray_distance on every lane, see sphere_packet_intersect
+static int quad_packet_intersect(const struct quad_packet* packet, const ray_t* ray, float tmin, float tmax, float* out_t)
+{
+#ifdef __SSE2__
+    const __m128 dir[3] = {_mm_set1_ps(ray->dir[0]), _mm_set1_ps(ray->dir[1]), _mm_set1_ps(ray->dir[2])};
+    __m128 origin[3], u[3], v[3], normal[3], w[3];
+    packet_load(packet->origin, origin);
+    packet_load(packet->u, u);
+    packet_load(packet->v, v);
+    packet_load(packet->normal, normal);
+    packet_load(packet->w, w);
+
+    const __m128 denom = packet_dot(normal, dir);
+    __m128 hit = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), denom), _mm_set1_ps(EPSILON));
+#ifdef BACKFACE_CULL
+    hit = _mm_and_ps(hit, _mm_cmple_ps(denom, _mm_setzero_ps()));
+#endif
 
-    if (start == end)
+    __m128 begin[3], diff[3];
+    for (int axis = 0; axis < 3; axis++)
     {
-        node->is_leaf = true;
-        node->underlying.leaf.index = start;
-        const scene_object_t* object = &self->objects[start];
-        aabb_copy(&object->aabb, &node->aabb);
-        return node_index;
+        begin[axis] = _mm_set1_ps(ray->begin[axis]);
+        diff[axis] = _mm_sub_ps(origin[axis], begin[axis]);
     }
+    const __m128 t = _mm_div_ps(packet_dot(normal, diff), denom);
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(tmin)), _mm_cmple_ps(t, _mm_set1_ps(tmax))));
 
-    aabb_t aabb;
-    aabb_copy(&self->objects[start].aabb, &aabb);
-    for (uint16_t i = start + 1; i <= end; i++)
+    __m128 p[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m128 pos = _mm_add_ps(_mm_mul_ps(dir[axis], t), begin[axis]);
+        p[axis] = _mm_sub_ps(pos, origin[axis]);
+    }
+    const __m128 v1[3] = {
+        _mm_sub_ps(_mm_mul_ps(p[1], v[2]), _mm_mul_ps(p[2], v[1])),
+        _mm_sub_ps(_mm_mul_ps(p[2], v[0]), _mm_mul_ps(p[0], v[2])),
+        _mm_sub_ps(_mm_mul_ps(p[0], v[1]), _mm_mul_ps(p[1], v[0]))
+    };
+    const __m128 v2[3] = {
+        _mm_sub_ps(_mm_mul_ps(u[1], p[2]), _mm_mul_ps(u[2], p[1])),
+        _mm_sub_ps(_mm_mul_ps(u[2], p[0]), _mm_mul_ps(u[0], p[2])),
+        _mm_sub_ps(_mm_mul_ps(u[0], p[1]), _mm_mul_ps(u[1], p[0]))
+    };
+    const __m128 alpha = packet_dot(w, v1);
+    const __m128 beta = packet_dot(w, v2);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(alpha, zero), _mm_cmple_ps(alpha, one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(beta, zero), _mm_cmple_ps(beta, one)));
+    return packet_nearest_lane(packet_select(hit, t, _mm_set1_ps(INFINITY)), out_t);
+#else
+    int nearest = -1;
+    for (int lane = 0; lane < LEAF_PACKET_WIDTH; lane++)
     {
-        aabb_merge(&aabb, &self->objects[i].aabb, &aabb);
+        quad_t quad;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            quad.origin[axis] = packet->origin[axis][lane];
+            quad.u[axis] = packet->u[axis][lane];
+            quad.v[axis] = packet->v[axis][lane];
+            quad.normal[axis] = packet->normal[axis][lane];
+            quad.w[axis] = packet->w[axis][lane];
+        }
+        if (quad_ray_distance(&quad, ray, tmin, tmax, out_t))
+        {
+            tmax = *out_t;
+            nearest = lane;
+        }
     }
-    const comparator compare_func = comparators[aabb_largest_axis(&aabb)];
-    qsort(&self->objects[start], end-start+1, sizeof(scene_object_t), compare_func);
-    const uint16_t mid = (start + end) / 2;
-    const uint16_t left = scene_build_bvh_node(self, start, mid);
-    const uint16_t right = scene_build_bvh_node(self, mid+1, end);
-    node->is_leaf = false;
-    node->underlying.children.left = left;
-    node->underlying.children.right = right;
-    aabb_merge(&self->bvh_nodes[left].aabb, &self->bvh_nodes[right].aabb, &node->aabb);
-    return node_index;
+    return nearest;
+#endif
 }
 #endif
 
-static void scene_base_init(scene_t* self)
+// The objects a traversal runs over, along with the structures built over them
+struct object_set
 {
-    self->num_objects = 0;
+    const scene_object_t* objects;
+    size_t num_objects;
 #ifdef USE_BVH
-    self->num_nodes = 0;
+    const bvh_t* bvh;
+    const leaf_prims_t* prims;
 #endif
-}
+};
 
-void scene_default_init(scene_t* self)
+#ifdef USE_BVH
+// Tests each of the leaf's ranges of spheres, quads and triangles with the kernel for its type, so there
+// is no dispatch per object. Objects are only looked up to record the closest hit
+static void ray_intersect_leaf_prims(const struct object_set* set, const struct leaf_ranges* leaf, const ray_t* ray, float tmin, struct closest_hit* closest)
 {
-    scene_base_init(self);
-    const vec3_t camera_pos = {-2.0f, 2.0f, 1.0f};
-    vec3_t forward;
-    vec3_sub((vec3_t){0.0, 0.0f, -1.0f}, camera_pos, forward);
-    camera_init(&self->camera, camera_pos, TO_RADS(10.0f), 3.4f, 100.0f, (float) PIXEL_WIDTH / PIXEL_HEIGHT, TO_RADS(5.0f));
-    camera_set_forward(&self->camera, forward);
+    const leaf_prims_t* prims = set->prims;
+    float t;
 
-    material_t* ground_mat = material_lambertian_solid_new((vec3_t){0.8f, 0.8f, 0.0f});
-    material_t* center_mat = material_lambertian_solid_new((vec3_t){0.1f, 0.2f, 0.5f});
-    material_t* left_mat = material_dielectric_new(1.5f);
-    material_t* bubble_mat = material_dielectric_new(1.0f / 1.5f);
-    material_t* right_mat = material_metal_new((vec3_t){0.8f, 0.6f, 0.2f}, 1.0f);
+    for (uint32_t i = leaf->first_sphere_packet; i < leaf->first_sphere_packet + leaf->num_sphere_packets; i++)
+    {
+        const int lane = sphere_packet_intersect(&prims->sphere_packets[i], ray, tmin, closest->t, &t);
+        if (lane >= 0) closest_hit_record(closest, &set->objects[prims->sphere_objects[i * LEAF_PACKET_WIDTH + lane]], t);
+    }
+    for (uint32_t i = leaf->first_quad_packet; i < leaf->first_quad_packet + leaf->num_quad_packets; i++)
+    {
+        const int lane = quad_packet_intersect(&prims->quad_packets[i], ray, tmin, closest->t, &t);
+        if (lane >= 0) closest_hit_record(closest, &set->objects[prims->quad_objects[i * LEAF_PACKET_WIDTH + lane]], t);
+    }
+    for (uint32_t i = leaf->first_triangle; i < leaf->first_triangle + leaf->num_triangles; i++)
+    {
+        const struct triangle_prim* triangle = &prims->triangles[i];
+        if (triangle_edges_ray_distance(triangle->v0, triangle->e1, triangle->e2, ray, tmin, closest->t, &t))
+        {
+            closest_hit_record(closest, &set->objects[prims->triangle_objects[i]], t);
+        }
+    }
+}
 
-    scene_add_sphere(self, ground_mat, (vec3_t){0.0f, -100.5f, -1.0f}, 100.0f);
-    scene_add_sphere(self, center_mat, (vec3_t){0.0f, 0.0f, -1.2f}, 0.5f);
-    scene_add_sphere(self, left_mat, (vec3_t){-1.0f, 0.0f, -1.0f}, 0.5f);
-    scene_add_sphere(self, bubble_mat, (vec3_t){-1.0f, 0.0f, -1.0f}, 0.4f);
-    scene_add_sphere(self, right_mat, (vec3_t){1.0f, 0.0f, -1.0f}, 0.5f);
+static void ray_intersect_leaf(const struct object_set* set, uint32_t offset, const ray_t* ray, float tmin, struct closest_hit* closest, ray_hit_t* out)
+{
+    const leaf_prims_t* prims = set->prims;
+    const struct leaf_ranges* leaf = &prims->leaves[prims->leaf_indices[offset]];
+    ray_intersect_leaf_prims(set, leaf, ray, tmin, closest);
+    for (uint32_t i = leaf->first_instance; i < leaf->first_instance + leaf->num_instances; i++)
+    {
+        if (instance_intersect_ray(&set->objects[prims->instance_objects[i]], ray, tmin, closest->t, out))
+        {
+            closest_hit_record(closest, NULL, out->t);
+        }
+    }
+}
 
-    BUILD_BVH_TREE(self);
+static bool ray_occluded_leaf(const struct object_set* set, uint32_t offset, const ray_t* ray, float tmin, float tmax)
+{
+    const leaf_prims_t* prims = set->prims;
+    const struct leaf_ranges* leaf = &prims->leaves[prims->leaf_indices[offset]];
+    float t;
 
-    material_release(right_mat);
-    material_release(bubble_mat);
-    material_release(left_mat);
-    material_release(center_mat);
-    material_release(ground_mat);
+    for (uint32_t i = leaf->first_sphere_packet; i < leaf->first_sphere_packet + leaf->num_sphere_packets; i++)
+    {
+        if (sphere_packet_intersect(&prims->sphere_packets[i], ray, tmin, tmax, &t) >= 0) return true;
+    }
+    for (uint32_t i = leaf->first_quad_packet; i < leaf->first_quad_packet + leaf->num_quad_packets; i++)
+    {
+        if (quad_packet_intersect(&prims->quad_packets[i], ray, tmin, tmax, &t) >= 0) return true;
+    }
+    for (uint32_t i = leaf->first_triangle; i < leaf->first_triangle + leaf->num_triangles; i++)
+    {
+        const struct triangle_prim* triangle = &prims->triangles[i];
+        if (triangle_edges_ray_distance(triangle->v0, triangle->e1, triangle->e2, ray, tmin, tmax, &t)) return true;
+    }
+    for (uint32_t i = leaf->first_instance; i < leaf->first_instance + leaf->num_instances; i++)
+    {
+        if (instance_occludes_ray(&set->objects[prims->instance_objects[i]], ray, tmin, tmax)) return true;
+    }
+    return false;
 }
+#endif
 
-void scene_random_init(scene_t* self)
+#if defined(USE_BVH) && BVH_WIDTH == 2
+static bool ray_intersect_bvh(const struct object_set* set, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
 {
-    scene_base_init(self);
+    uint32_t stack[BVH_STACK_SIZE];
+
+    size_t stack_len = 0;
+    stack[stack_len++] = 0;
+    struct closest_hit closest = {NULL, tmax, false};
+    size_t nodes_visited = 0;
+
+    bvh_ray_t bvh_ray;
+    bvh_ray_init(ray->begin, ray->dir, &bvh_ray);
+
+    while (stack_len > 0)
+    {
+        const bvh_node_t* node = &set->bvh->nodes[stack[--stack_len]];
+        nodes_visited++;
+
+        // Boxes are tested against the closest hit so far, so subtrees behind it are skipped
+        if (!bvh_ray_intersect_aabb(&bvh_ray, &node->aabb, tmin, closest.t)) continue;
+
+        if (bvh_node_is_leaf(node))
+        {
+            ray_intersect_leaf(set, node->offset, ray, tmin, &closest, out);
+            continue;
+        }
+
+        // The left child holds the lower half along the split axis, so it is nearer unless the ray
+        // points down that axis. The far child is pushed first so the near one is popped next
+        const uint32_t near_is_right = bvh_ray.dir_is_neg[bvh_node_axis(node)];
+        stack[stack_len++] = node->offset + !near_is_right;
+        stack[stack_len++] = node->offset + near_is_right;
+    }
+    BVH_STATS_RECORD(nodes_visited);
+    return closest_hit_finish(&closest, ray, out);
+}
+#endif
+
+#if defined(USE_BVH) && BVH_WIDTH == 2
+// Any-hit traversal: stops at the first primitive in range, so child order does not matter
+static bool ray_occluded_bvh(const struct object_set* set, const ray_t* ray, float tmin, float tmax)
+{
+    uint32_t stack[BVH_STACK_SIZE];
+
+    size_t stack_len = 0;
+    stack[stack_len++] = 0;
+    size_t nodes_visited = 0;
+
+    bvh_ray_t bvh_ray;
+    bvh_ray_init(ray->begin, ray->dir, &bvh_ray);
+
+    while (stack_len > 0)
+    {
+        const bvh_node_t* node = &set->bvh->nodes[stack[--stack_len]];
+        nodes_visited++;
+
+        if (!bvh_ray_intersect_aabb(&bvh_ray, &node->aabb, tmin, tmax)) continue;
+
+        if (bvh_node_is_leaf(node))
+        {
+            if (ray_occluded_leaf(set, node->offset, ray, tmin, tmax))
+            {
+                BVH_STATS_RECORD(nodes_visited);
+                return true;
+            }
+            continue;
+        }
+
+        stack[stack_len++] = node->offset + 1;
+        stack[stack_len++] = node->offset;
+    }
+    BVH_STATS_RECORD(nodes_visited);
+    return false;
+}
+#endif
+
+#if defined(USE_BVH) && BVH_WIDTH == 4
+// The bvh_ray_t terms splatted across four lanes, with the plane index (min or max) that is nearest
+// along each axis
+struct bvh4_ray
+{
+#ifdef __SSE2__
+    __m128 inv_dir[3];
+    __m128 origin_inv_dir[3];
+#else
+    vec3_t inv_dir;
+    vec3_t origin_inv_dir;
+#endif
+    int near_plane[3];
+};
+
+struct bvh4_stack_entry
+{
+    uint32_t child;
+    uint32_t count;
+    float tnear;
+};
+
+static void bvh4_ray_init(const ray_t* ray, struct bvh4_ray* out)
+{
+    bvh_ray_t bvh_ray;
+    bvh_ray_init(ray->begin, ray->dir, &bvh_ray);
+    for (int axis = 0; axis < 3; axis++)
+    {
+#ifdef __SSE2__
+        out->inv_dir[axis] = _mm_set1_ps(bvh_ray.inv_dir[axis]);
+        out->origin_inv_dir[axis] = _mm_set1_ps(bvh_ray.origin_inv_dir[axis]);
+#else
+        out->inv_dir[axis] = bvh_ray.inv_dir[axis];
+        out->origin_inv_dir[axis] = bvh_ray.origin_inv_dir[axis];
+#endif
+        out->near_plane[axis] = bvh_ray.dir_is_neg[axis];
+    }
+}
+
+// Slab test against all four child boxes at once. Returns a bit mask of the children that were hit
+// and writes each child's entry distance to out_tnear. tmax is clamped to a finite value so that
+// unused lanes, whose boxes sit at infinity, always miss
+static int bvh4_intersect_children(const bvh4_node_t* node, const struct bvh4_ray* ray, float tmin, float tmax, float out_tnear[4])
+{
+#ifdef __SSE2__
+    __m128 tnear = _mm_set1_ps(tmin);
+    __m128 tfar = _mm_set1_ps(fminf(tmax, FLT_MAX));
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m128 near = _mm_load_ps(node->bounds[ray->near_plane[axis]][axis]);
+        const __m128 far = _mm_load_ps(node->bounds[1 - ray->near_plane[axis]][axis]);
+        tnear = _mm_max_ps(_mm_sub_ps(_mm_mul_ps(near, ray->inv_dir[axis]), ray->origin_inv_dir[axis]), tnear);
+        tfar = _mm_min_ps(_mm_sub_ps(_mm_mul_ps(far, ray->inv_dir[axis]), ray->origin_inv_dir[axis]), tfar);
+    }
+
+    _mm_storeu_ps(out_tnear, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        float tnear = tmin;
+        float tfar = fminf(tmax, FLT_MAX);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float near = node->bounds[ray->near_plane[axis]][axis][i];
+            const float far = node->bounds[1 - ray->near_plane[axis]][axis][i];
+            tnear = fmaxf(near * ray->inv_dir[axis] - ray->origin_inv_dir[axis], tnear);
+            tfar = fminf(far * ray->inv_dir[axis] - ray->origin_inv_dir[axis], tfar);
+        }
+        out_tnear[i] = tnear;
+        mask |= (tnear <= tfar) << i;
+    }
+    return mask;
+#endif
+}
+
+static bool ray_intersect_bvh4(const struct object_set* set, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+{
+    struct bvh4_stack_entry stack[BVH4_STACK_SIZE];
+    size_t stack_len = 0;
+    stack[stack_len++] = (struct bvh4_stack_entry){0, 0, tmin};
+    struct closest_hit closest = {NULL, tmax, false};
+    size_t nodes_visited = 0;
+
+    struct bvh4_ray bvh4_ray;
+    bvh4_ray_init(ray, &bvh4_ray);
+
+    while (stack_len > 0)
+    {
+        const struct bvh4_stack_entry entry = stack[--stack_len];
+        if (entry.tnear > closest.t) continue;
+
+        if (entry.count > 0)
+        {
+            ray_intersect_leaf(set, entry.child, ray, tmin, &closest, out);
+            continue;
+        }
+
+        const bvh4_node_t* node = &set->bvh->bvh4_nodes[entry.child];
+        nodes_visited++;
+        float tnear[4];
+        int mask = bvh4_intersect_children(node, &bvh4_ray, tmin, closest.t, tnear);
+
+        // Push hit children farthest first so the nearest one is popped next
+        const size_t first = stack_len;
+        while (mask)
+        {
+            const int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            size_t j = stack_len++;
+            while (j > first && stack[j - 1].tnear < tnear[i])
+            {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = (struct bvh4_stack_entry){node->children[i], node->counts[i], tnear[i]};
+        }
+    }
+    BVH_STATS_RECORD(nodes_visited);
+    return closest_hit_finish(&closest, ray, out);
+}
+#endif
+
+#if defined(USE_BVH) && BVH_WIDTH == 4
+// Any-hit traversal: tmax never shrinks and the first primitive in range ends the query, so children
+// are pushed without sorting or remembering their entry distance
+static bool ray_occluded_bvh4(const struct object_set* set, const ray_t* ray, float tmin, float tmax)
+{
+    struct bvh4_stack_entry stack[BVH4_STACK_SIZE];
+    size_t stack_len = 0;
+    stack[stack_len++] = (struct bvh4_stack_entry){0, 0, tmin};
+    size_t nodes_visited = 0;
+
+    struct bvh4_ray bvh4_ray;
+    bvh4_ray_init(ray, &bvh4_ray);
+
+    while (stack_len > 0)
+    {
+        const struct bvh4_stack_entry entry = stack[--stack_len];
+
+        if (entry.count > 0)
+        {
+            if (ray_occluded_leaf(set, entry.child, ray, tmin, tmax))
+            {
+                BVH_STATS_RECORD(nodes_visited);
+                return true;
+            }
+            continue;
+        }
+
+        const bvh4_node_t* node = &set->bvh->bvh4_nodes[entry.child];
+        nodes_visited++;
+        float tnear[4];
+        int mask = bvh4_intersect_children(node, &bvh4_ray, tmin, tmax, tnear);
+        while (mask)
+        {
+            const int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            stack[stack_len++] = (struct bvh4_stack_entry){node->children[i], node->counts[i], 0.0f};
+        }
+    }
+    BVH_STATS_RECORD(nodes_visited);
+    return false;
+}
+#endif
+
+#if defined(USE_BVH) && BVH_WIDTH == 4
+struct bvh4_packet_entry
+{
+    uint32_t child;
+    uint32_t count;
+    // No ray of the packet before this one hits the child
+    uint32_t first_ray;
+    // Node the child belongs to and its index there, so leaves can test their box against each ray once
+    // they are reached, with the rays' closest hits by then
+    uint32_t parent;
+    uint32_t parent_slot;
+};
+
+// The packet's rays in structure of arrays layout, so one box can be tested against four rays at once
+struct bvh4_packet_rays
+{
+    _Alignas(16) float inv_dir[3][RAY_PACKET_SIZE];
+    _Alignas(16) float origin_inv_dir[3][RAY_PACKET_SIZE];
+    // All bits set along the axes where the ray's direction is negative, selecting the box's far side
+    // as its near plane
+    _Alignas(16) uint32_t dir_is_neg[3][RAY_PACKET_SIZE];
+    // Each ray's closest hit so far, clamped to a finite value like in bvh4_intersect_children
+    _Alignas(16) float tmax[RAY_PACKET_SIZE];
+};
+
+static void bvh4_packet_rays_init(const ray_t* rays, size_t num_rays, const struct closest_hit* closest, struct bvh4_packet_rays* out)
+{
+    // Lanes past the last ray up to the end of its group of four repeat it and are masked out of every result
+    for (size_t r = 0; r < ((num_rays + 3) & ~(size_t) 3); r++)
+    {
+        const size_t src = r < num_rays ? r : num_rays - 1;
+        bvh_ray_t bvh_ray;
+        bvh_ray_init(rays[src].begin, rays[src].dir, &bvh_ray);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            out->inv_dir[axis][r] = bvh_ray.inv_dir[axis];
+            out->origin_inv_dir[axis][r] = bvh_ray.origin_inv_dir[axis];
+            out->dir_is_neg[axis][r] = bvh_ray.dir_is_neg[axis] ? UINT32_MAX : 0;
+        }
+        out->tmax[r] = fminf(closest[src].t, FLT_MAX);
+    }
+}
+
+// Ray r of the packet in the layout bvh4_intersect_children takes, to test it against all four children
+static void bvh4_packet_rays_get(const struct bvh4_packet_rays* rays, size_t r, struct bvh4_ray* out)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+#ifdef __SSE2__
+        out->inv_dir[axis] = _mm_set1_ps(rays->inv_dir[axis][r]);
+        out->origin_inv_dir[axis] = _mm_set1_ps(rays->origin_inv_dir[axis][r]);
+#else
+        out->inv_dir[axis] = rays->inv_dir[axis][r];
+        out->origin_inv_dir[axis] = rays->origin_inv_dir[axis][r];
+#endif
+        out->near_plane[axis] = rays->dir_is_neg[axis][r] ? 1 : 0;
+    }
+}
+
+// Slab test of child i of the node against rays first to first + 3. Returns a bit mask of the rays that
+// hit it and writes their entry distances to out_tnear. Computes exactly what bvh4_intersect_children
+// does for each ray, so both agree on every box
+static int bvh4_packet_rays_intersect_child(const bvh4_node_t* node, int i, const struct bvh4_packet_rays* rays, size_t first, float tmin, float out_tnear[4])
+{
+#ifdef __SSE2__
+    __m128 tnear = _mm_set1_ps(tmin);
+    __m128 tfar = _mm_load_ps(&rays->tmax[first]);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m128 min = _mm_set1_ps(node->bounds[0][axis][i]);
+        const __m128 max = _mm_set1_ps(node->bounds[1][axis][i]);
+        const __m128 neg = _mm_castsi128_ps(_mm_load_si128((const __m128i*) &rays->dir_is_neg[axis][first]));
+        const __m128 near = _mm_or_ps(_mm_and_ps(neg, max), _mm_andnot_ps(neg, min));
+        const __m128 far = _mm_or_ps(_mm_and_ps(neg, min), _mm_andnot_ps(neg, max));
+        const __m128 inv_dir = _mm_load_ps(&rays->inv_dir[axis][first]);
+        const __m128 origin_inv_dir = _mm_load_ps(&rays->origin_inv_dir[axis][first]);
+        tnear = _mm_max_ps(_mm_sub_ps(_mm_mul_ps(near, inv_dir), origin_inv_dir), tnear);
+        tfar = _mm_min_ps(_mm_sub_ps(_mm_mul_ps(far, inv_dir), origin_inv_dir), tfar);
+    }
+
+    _mm_storeu_ps(out_tnear, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        const size_t r = first + lane;
+        float tnear = tmin;
+        float tfar = rays->tmax[r];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const int near_plane = rays->dir_is_neg[axis][r] ? 1 : 0;
+            const float near = node->bounds[near_plane][axis][i];
+            const float far = node->bounds[1 - near_plane][axis][i];
+            tnear = fmaxf(near * rays->inv_dir[axis][r] - rays->origin_inv_dir[axis][r], tnear);
+            tfar = fminf(far * rays->inv_dir[axis][r] - rays->origin_inv_dir[axis][r], tfar);
+        }
+        out_tnear[lane] = tnear;
+        mask |= (tnear <= tfar) << lane;
+    }
+    return mask;
+#endif
+}
+
+// Mask of the rays from first on that hit child i of the node, four at a time. If stop_at_first, returns
+// as soon as one is found. Writes the entry distance of the lowest ray found to out_tnear
+static uint32_t bvh4_packet_rays_hit_child(const bvh4_node_t* node, int i, const struct bvh4_packet_rays* rays, size_t first, size_t num_rays, float tmin, bool stop_at_first, float* out_tnear)
+{
+    // Shifting by the full width is undefined, so a full packet is spelled out
+    const uint32_t valid = num_rays == 32 ? UINT32_MAX : (1u << num_rays) - 1;
+    uint32_t ray_mask = 0;
+    for (size_t group = first & ~(size_t) 3; group < num_rays; group += 4)
+    {
+        float tnear[4];
+        const uint32_t mask = ((uint32_t) bvh4_packet_rays_intersect_child(node, i, rays, group, tmin, tnear) << group) &
+            valid & ~((1u << first) - 1);
+        if (!ray_mask && mask) *out_tnear = tnear[__builtin_ctz(mask) - group];
+        ray_mask |= mask;
+        if (stop_at_first && ray_mask) break;
+    }
+    return ray_mask;
+}
+
+static void ray_intersect_bvh4_packet(const struct object_set* set, const ray_t* rays, size_t num_rays, const float* tmin, struct closest_hit* closest, ray_hit_t* out);
+
+static struct object_set geometry_object_set(const geometry_t* self);
+
+// instance_intersect_ray for the rays of ray_mask, which go through the instance's geometry as one packet
+static void instance_intersect_packet(const scene_object_t* self, const ray_t* rays, uint32_t ray_mask, const float* tmin, struct closest_hit* closest, ray_hit_t* out)
+{
+    const instance_t* instance = &self->underlying.instance;
+    ray_t local_rays[RAY_PACKET_SIZE];
+    float scales[RAY_PACKET_SIZE];
+    float local_tmin[RAY_PACKET_SIZE];
+    struct closest_hit local_closest[RAY_PACKET_SIZE];
+    ray_hit_t local_out[RAY_PACKET_SIZE];
+    uint32_t indices[RAY_PACKET_SIZE];
+    size_t num_rays = 0;
+    for (; ray_mask; ray_mask &= ray_mask - 1)
+    {
+        const int r = __builtin_ctz(ray_mask);
+        instance_transform_ray(instance, &rays[r], &local_rays[num_rays], &scales[num_rays]);
+        local_tmin[num_rays] = tmin[r] * scales[num_rays];
+        local_closest[num_rays] = (struct closest_hit){NULL, closest[r].t * scales[num_rays], false};
+        indices[num_rays++] = r;
+    }
+
+    const struct object_set set = geometry_object_set(instance->geometry);
+    ray_intersect_bvh4_packet(&set, local_rays, num_rays, local_tmin, local_closest, local_out);
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        if (!closest_hit_finish(&local_closest[i], &local_rays[i], &local_out[i])) continue;
+        const uint32_t r = indices[i];
+        ray_hit_copy(&local_out[i], &out[r]);
+        instance_set_hit(instance, &rays[r], scales[i], &out[r]);
+        closest_hit_record(&closest[r], NULL, out[r].t);
+    }
+}
+
+// ray_intersect_leaf for the rays of ray_mask. Instances take the rays together
+static void ray_intersect_leaf_packet(const struct object_set* set, uint32_t offset, const ray_t* rays, uint32_t ray_mask, const float* tmin, struct closest_hit* closest, ray_hit_t* out)
+{
+    const leaf_prims_t* prims = set->prims;
+    const struct leaf_ranges* leaf = &prims->leaves[prims->leaf_indices[offset]];
+    for (uint32_t rest = ray_mask; rest; rest &= rest - 1)
+    {
+        const int r = __builtin_ctz(rest);
+        ray_intersect_leaf_prims(set, leaf, &rays[r], tmin[r], &closest[r]);
+    }
+    for (uint32_t i = leaf->first_instance; i < leaf->first_instance + leaf->num_instances; i++)
+    {
+        instance_intersect_packet(&set->objects[prims->instance_objects[i]], rays, ray_mask, tmin, closest, out);
+    }
+}
+
+// ray_intersect_bvh4 for a packet of rays sharing one traversal stack, leaving the closest hits to be
+// finished. An inner child is entered by the whole packet as soon as one ray hits it, trying the first
+// ray that may against all four children at once and then four rays at a time against each child it
+// missed, so for coherent rays a node usually costs a single slab test however many rays there are.
+// Leaves find exactly which rays hit their box once reached, since those rays go on to test every
+// primitive in them. Boxes are tested from the smallest tmin of the packet, primitives from each ray's own
+static void ray_intersect_bvh4_packet(const struct object_set* set, const ray_t* rays, size_t num_rays, const float* tmin, struct closest_hit* closest, ray_hit_t* out)
+{
+    struct bvh4_packet_rays packet_rays;
+    bvh4_packet_rays_init(rays, num_rays, closest, &packet_rays);
+    float packet_tmin = INFINITY;
+    for (size_t r = 0; r < num_rays; r++)
+    {
+        packet_tmin = fminf(packet_tmin, tmin[r]);
+    }
+
+    struct bvh4_packet_entry stack[BVH4_STACK_SIZE];
+    size_t stack_len = 0;
+    stack[stack_len++] = (struct bvh4_packet_entry){0, 0, 0, 0, 0};
+    size_t nodes_visited = 0;
+
+    while (stack_len > 0)
+    {
+        const struct bvh4_packet_entry entry = stack[--stack_len];
+
+        if (entry.count > 0)
+        {
+            const bvh4_node_t* parent = &set->bvh->bvh4_nodes[entry.parent];
+            float unused;
+            const uint32_t ray_mask = bvh4_packet_rays_hit_child(parent, entry.parent_slot, &packet_rays, entry.first_ray, num_rays, packet_tmin, false, &unused);
+            if (!ray_mask) continue;
+            ray_intersect_leaf_packet(set, entry.child, rays, ray_mask, tmin, closest, out);
+            for (uint32_t rest = ray_mask; rest; rest &= rest - 1)
+            {
+                const int r = __builtin_ctz(rest);
+                packet_rays.tmax[r] = fminf(closest[r].t, FLT_MAX);
+            }
+            continue;
+        }
+
+        const bvh4_node_t* node = &set->bvh->bvh4_nodes[entry.child];
+        nodes_visited++;
+        uint32_t first_ray[4];
+        float tnear[4];
+        struct bvh4_ray first;
+        bvh4_packet_rays_get(&packet_rays, entry.first_ray, &first);
+        int mask = bvh4_intersect_children(node, &first, packet_tmin, closest[entry.first_ray].t, tnear);
+        for (int rest = mask; rest; rest &= rest - 1)
+        {
+            first_ray[__builtin_ctz(rest)] = entry.first_ray;
+        }
+        if (entry.first_ray + 1 < num_rays)
+        {
+            for (int rest = ~mask & 0xF; rest; rest &= rest - 1)
+            {
+                const int i = __builtin_ctz(rest);
+                // Cleared lanes, child 0 with no primitives, sit at infinity and no ray can hit them
+                if (node->children[i] == 0 && node->counts[i] == 0) continue;
+                const uint32_t ray_mask = bvh4_packet_rays_hit_child(node, i, &packet_rays, entry.first_ray + 1, num_rays, packet_tmin, true, &tnear[i]);
+                if (!ray_mask) continue;
+                first_ray[i] = __builtin_ctz(ray_mask);
+                mask |= 1 << i;
+            }
+        }
+
+        // Push hit children farthest first, by the entry distance of the first ray that hit each, so the
+        // nearest one is popped next
+        int order[4];
+        int num_hit = 0;
+        for (; mask; mask &= mask - 1)
+        {
+            const int i = __builtin_ctz(mask);
+            int j = num_hit++;
+            while (j > 0 && tnear[order[j - 1]] < tnear[i])
+            {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+        for (int j = 0; j < num_hit; j++)
+        {
+            const int i = order[j];
+            stack[stack_len++] = (struct bvh4_packet_entry){node->children[i], node->counts[i], first_ray[i], entry.child, i};
+        }
+    }
+
+    for (size_t r = 0; r < num_rays; r++)
+    {
+        // Node fetches are shared, so they count once for the packet
+        BVH_STATS_RECORD(r == 0 ? nodes_visited : 0);
+    }
+}
+#endif
+
+static bool ray_intersect_no_bvh(const struct object_set* set, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+{
+    struct closest_hit closest = {NULL, tmax, false};
+    for (size_t i = 0; i < set->num_objects; i++)
+    {
+        ray_intersect_object_closest(ray, &set->objects[i], tmin, &closest, out);
+    }
+    return closest_hit_finish(&closest, ray, out);
+}
+
+#ifndef USE_BVH
+static bool ray_occluded_no_bvh(const struct object_set* set, const ray_t* ray, float tmin, float tmax)
+{
+    for (size_t i = 0; i < set->num_objects; i++)
+    {
+        if (scene_object_occludes_ray(ray, &set->objects[i], tmin, tmax)) return true;
+    }
+    return false;
+}
+#endif
+
+static bool ray_intersect_object_set(const struct object_set* set, const ray_t* ray, float tmin, float tmax, ray_hit_t* out)
+{
+#if defined(USE_BVH) && BVH_WIDTH == 4
+    return ray_intersect_bvh4(set, ray, tmin, tmax, out);
+#elif defined(USE_BVH)
+    return ray_intersect_bvh(set, ray, tmin, tmax, out);
+#else
+    return ray_intersect_no_bvh(set, ray, tmin, tmax, out);
+#endif
+}
+
+static bool ray_occluded_object_set(const struct object_set* set, const ray_t* ray, float tmin, float tmax)
+{
+#if defined(USE_BVH) && BVH_WIDTH == 4
+    return ray_occluded_bvh4(set, ray, tmin, tmax);
+#elif defined(USE_BVH)
+    return ray_occluded_bvh(set, ray, tmin, tmax);
+#else
+    return ray_occluded_no_bvh(set, ray, tmin, tmax);
+#endif
+}
+
+static void scene_object_destroy(scene_object_t* self)
+{
+    switch (self->type)
+    {
+        case OBJECT_INSTANCE:
+            geometry_release(self->underlying.instance.geometry);
+            break;
+        case OBJECT_TRIANGLE:
+            mesh_release(self->underlying.triangle.mesh);
+            material_release(self->material);
+            break;
+        default:
+            material_release(self->material);
+    }
+}
+
+#ifdef USE_BVH
+// The tree only depends on the object bounds and build settings, which the cache key covers, so the
+// cached tree is reused whenever the same objects are built again
+static void bvh_build_cached(bvh_t* bvh, const aabb_t* aabbs, size_t num_objects)
+{
+    const char* dir = getenv(BVH_CACHE_DIR_ENV);
+    char path[4096];
+    if (!dir || !*dir || num_objects < BVH_CACHE_MIN_PRIMS)
+    {
+        bvh_build(bvh, aabbs, num_objects);
+        return;
+    }
+    const uint64_t key = bvh_cache_key(aabbs, num_objects);
+    if (snprintf(path, sizeof(path), "%s/%016" PRIx64 ".bvh", dir, key) >= (int) sizeof(path))
+    {
+        bvh_build(bvh, aabbs, num_objects);
+        return;
+    }
+    if (bvh_load(bvh, path, key, num_objects)) return;
+
+    bvh_build(bvh, aabbs, num_objects);
+    mkdir(dir, 0755);
+    if (!bvh_save(bvh, path, key))
+    {
+        fprintf(stderr, "Failed to write BVH cache %s\n", path);
+        return;
+    }
+    bvh_cache_trim(dir, BVH_CACHE_MAX_BYTES);
+}
+#endif
+
+static void objects_build_bvh(bvh_t* bvh, const scene_object_t* objects, size_t num_objects)
+{
+#ifdef USE_BVH
+    aabb_t* aabbs = malloc(sizeof(aabb_t) * num_objects);
+    for (size_t i = 0; i < num_objects; i++)
+    {
+        aabb_copy(&objects[i].aabb, &aabbs[i]);
+    }
+    bvh_build_cached(bvh, aabbs, num_objects);
+    free(aabbs);
+#else
+    (void) bvh;
+    (void) objects;
+    (void) num_objects;
+#endif
+}
+
+geometry_t* geometry_new(void)
+{
+    geometry_t* ret = malloc(sizeof(geometry_t));
+    ret->objects = NULL;
+    ret->num_objects = 0;
+    ret->capacity = 0;
+#ifdef USE_BVH
+    bvh_init(&ret->bvh);
+    leaf_prims_init(&ret->prims);
+#endif
+    ret->ref_count = 1;
+    return ret;
+}
+
+static scene_object_t* geometry_push_object(geometry_t* self)
+{
+    return objects_push(&self->objects, &self->num_objects, &self->capacity);
+}
+
+void geometry_add_sphere(geometry_t* self, material_t* material, const vec3_t center, float radius)
+{
+    scene_object_sphere_init(geometry_push_object(self), material, center, radius);
+}
+
+void geometry_add_quad(geometry_t* self, material_t* material, const vec3_t origin, const vec3_t u, const vec3_t v)
+{
+    scene_object_quad_init(geometry_push_object(self), material, origin, u, v);
+}
+
+void geometry_add_mesh(geometry_t* self, mesh_t* mesh, material_t* material)
+{
+    assert(mesh->num_triangles < UINT32_MAX);
+    objects_reserve(&self->objects, &self->capacity, self->num_objects + mesh->num_triangles);
+    for (size_t i = 0; i < mesh->num_triangles; i++)
+    {
+        scene_object_triangle_init(geometry_push_object(self), material, mesh, i);
+    }
+}
+
+void geometry_add_instance(geometry_t* self, geometry_t* other, const mat34_t* object_to_world)
+{
+    assert(self != other);
+    scene_object_instance_init(geometry_push_object(self), other, object_to_world);
+}
+
+void geometry_build_bvh(geometry_t* self)
+{
+    assert(self->num_objects > 0);
+#ifdef USE_BVH
+    objects_build_bvh(&self->bvh, self->objects, self->num_objects);
+    leaf_prims_build(&self->prims, self->objects, &self->bvh);
+#endif
+}
+
+geometry_t* geometry_acquire(geometry_t* self)
+{
+    self->ref_count++;
+    return self;
+}
+
+void geometry_release(geometry_t* self)
+{
+    if (--self->ref_count > 0) return;
+
+    for (size_t i = 0; i < self->num_objects; i++)
+    {
+        scene_object_destroy(&self->objects[i]);
+    }
+    free(self->objects);
+#ifdef USE_BVH
+    bvh_destroy(&self->bvh);
+    leaf_prims_destroy(&self->prims);
+#endif
+    free(self);
+}
+
+static struct object_set geometry_object_set(const geometry_t* self)
+{
+    struct object_set set = {.objects = self->objects, .num_objects = self->num_objects};
+#ifdef USE_BVH
+    set.bvh = &self->bvh;
+    set.prims = &self->prims;
+#endif
+    return set;
+}
+
+static bool ray_intersect_geometry(const ray_t* ray, const geometry_t* geometry, float tmin, float tmax, ray_hit_t* out)
+{
+    const struct object_set set = geometry_object_set(geometry);
+    return ray_intersect_object_set(&set, ray, tmin, tmax, out);
+}
+
+static bool ray_occluded_geometry(const ray_t* ray, const geometry_t* geometry, float tmin, float tmax)
+{
+    const struct object_set set = geometry_object_set(geometry);
+    return ray_occluded_object_set(&set, ray, tmin, tmax);
+}
+
+static void scene_base_init(scene_t* self)
+{
+    self->objects = NULL;
+    self->num_objects = 0;
+    self->capacity = 0;
+#ifdef USE_BVH
+    bvh_init(&self->bvh);
+    leaf_prims_init(&self->prims);
+#endif
+    self->light_objects = NULL;
+    self->light_cdf = NULL;
+    self->num_lights = 0;
+}
+
+void scene_default_init(scene_t* self)
+{
+    scene_base_init(self);
+    const vec3_t camera_pos = {-2.0f, 2.0f, 1.0f};
+    vec3_t forward;
+    vec3_sub((vec3_t){0.0, 0.0f, -1.0f}, camera_pos, forward);
+    camera_init(&self->camera, camera_pos, TO_RADS(10.0f), 3.4f, 100.0f, (float) PIXEL_WIDTH / PIXEL_HEIGHT, TO_RADS(5.0f));
+    camera_set_forward(&self->camera, forward);
+
+    material_t* ground_mat = material_lambertian_solid_new((vec3_t){0.8f, 0.8f, 0.0f});
+    material_t* center_mat = material_lambertian_solid_new((vec3_t){0.1f, 0.2f, 0.5f});
+    material_t* left_mat = material_dielectric_new(1.5f);
+    material_t* bubble_mat = material_dielectric_new(1.0f / 1.5f);
+    material_t* right_mat = material_metal_new((vec3_t){0.8f, 0.6f, 0.2f}, 1.0f);
+
+    scene_add_sphere(self, ground_mat, (vec3_t){0.0f, -100.5f, -1.0f}, 100.0f);
+    scene_add_sphere(self, center_mat, (vec3_t){0.0f, 0.0f, -1.2f}, 0.5f);
+    scene_add_sphere(self, left_mat, (vec3_t){-1.0f, 0.0f, -1.0f}, 0.5f);
+    scene_add_sphere(self, bubble_mat, (vec3_t){-1.0f, 0.0f, -1.0f}, 0.4f);
+    scene_add_sphere(self, right_mat, (vec3_t){1.0f, 0.0f, -1.0f}, 0.5f);
+
+
+    material_release(right_mat);
+    material_release(bubble_mat);
+    material_release(left_mat);
+    material_release(center_mat);
+    material_release(ground_mat);
+}
+
+void scene_random_init(scene_t* self)
+{
+    scene_base_init(self);
     const vec3_t ground_sphere_center = {0.0f, 0.0f, 0.0f};
     const float ground_sphere_radius = 1000.0f;
+    const int num_spheres = 1000;
     texture_t* ground_tex = texture_checkered_solid_new((vec3_t){1.0f, 1.0f, 1.0f}, (vec3_t){0.0f, 0.0f, 0.0f}, 5.0f);
     material_t* ground_mat = material_lambertian_new(ground_tex);
-    const scene_object_t* ground = scene_add_sphere(self, ground_mat, ground_sphere_center, ground_sphere_radius);
+    scene_reserve(self, num_spheres + 1);
+    // Copied out since adding spheres may move the scene's objects
+    const sphere_t ground = scene_add_sphere(self, ground_mat, ground_sphere_center, ground_sphere_radius)->underlying.sphere;
    
     // Place camera at phi = 0
     vec3_t camera_pos;
@@ -505,11 +1826,10 @@ void scene_random_init(scene_t* self)
     //material_t* sun_mat = material_point_light_new((vec3_t){1.0f, 0.95f, 0.9f});
     //scene_add_sphere(self, sun_mat, (vec3_t){0.0f, 20000.0f, -20000.0f}, 10000.0f);
 
-    for (int i = 0; i < 1000; i++)
+    for (int i = 0; i < num_spheres; i++)
     {
-        while (!try_place_random_sphere_on_sphere(self, &ground->underlying.sphere));
+        while (!try_place_random_sphere_on_sphere(self, &ground));
     }
-    BUILD_BVH_TREE(self);
 
     material_release(ground_mat);
     texture_release(ground_tex);
@@ -554,23 +1874,26 @@ void scene_cornell_box_init(scene_t* self)
     // Enclosing wall
     //scene_add_quad(self, white_mirror_mat, (vec3_t){0.0f, 0.0f, 0.0f}, (vec3_t){w, 0.0f, 0.0f}, (vec3_t){0.0f, h, 0.0f});
 
-    // Box 1
-    scene_add_quad(self, white_mat, (vec3_t){130.0f, 165.0f, 65.0f}, (vec3_t){-48.0f, 0.0f, 160.0f}, (vec3_t){160.0f, 0.0f, 49.0f});
-    scene_add_quad(self, white_mat, (vec3_t){290.0f, 0.0f, 114.0f}, (vec3_t){0.0f, 165.0f, 0.0f}, (vec3_t){-50.0f, 0.0f, 158.0f});
-    scene_add_quad(self, white_mat, (vec3_t){130.0f, 0.0f, 65.0f}, (vec3_t){0.0f, 165.0f, 0.0f}, (vec3_t){160.0f, 0.0f, 49.0f});
-    scene_add_quad(self, white_mat, (vec3_t){82.0f, 0.0f, 225.0f}, (vec3_t){0.0f, 165.0f, 0.0f}, (vec3_t){48.0f, 0.0f, -160.0f});
-    scene_add_quad(self, white_mat, (vec3_t){240.0f, 0.0f, 272.0f}, (vec3_t){0.0f, 165.0f, 0.0f}, (vec3_t){-158.0f, 0.0f, -47.0f});
+    // Both boxes are instances of one open-bottomed unit cube, stretched and rotated about y
+    geometry_t* box = geometry_new();
+    geometry_add_quad(box, white_mat, (vec3_t){0.0f, 1.0f, 0.0f}, (vec3_t){0.0f, 0.0f, 1.0f}, (vec3_t){1.0f, 0.0f, 0.0f});
+    geometry_add_quad(box, white_mat, (vec3_t){0.0f, 0.0f, 0.0f}, (vec3_t){0.0f, 0.0f, 1.0f}, (vec3_t){0.0f, 1.0f, 0.0f});
+    geometry_add_quad(box, white_mat, (vec3_t){1.0f, 0.0f, 0.0f}, (vec3_t){0.0f, 1.0f, 0.0f}, (vec3_t){0.0f, 0.0f, 1.0f});
+    geometry_add_quad(box, white_mat, (vec3_t){0.0f, 0.0f, 0.0f}, (vec3_t){0.0f, 1.0f, 0.0f}, (vec3_t){1.0f, 0.0f, 0.0f});
+    geometry_add_quad(box, white_mat, (vec3_t){0.0f, 0.0f, 1.0f}, (vec3_t){1.0f, 0.0f, 0.0f}, (vec3_t){0.0f, 1.0f, 0.0f});
+    geometry_build_bvh(box);
 
+    mat34_t transform;
+    // Box 1
+    mat34_from_axes((vec3_t){160.0f, 0.0f, 49.0f}, (vec3_t){0.0f, 165.0f, 0.0f}, (vec3_t){-48.0f, 0.0f, 160.0f}, (vec3_t){130.0f, 0.0f, 65.0f}, &transform);
+    scene_add_instance(self, box, &transform);
     // Box 2
-    scene_add_quad(self, white_mat, (vec3_t){423.0f, 330.0f, 247.0f}, (vec3_t){-158.0f, 0.0f, 49.0f}, (vec3_t){49.0f, 0.0f, 159.0f});
-    scene_add_quad(self, white_mat, (vec3_t){423.0f, 0.0f, 247.0f}, (vec3_t){0.0f, 330.0f, 0.0f}, (vec3_t){49.0f, 0.0f, 159.0f});
-    scene_add_quad(self, white_mat, (vec3_t){472.0f, 0.0f, 406.0f}, (vec3_t){0.0f, 330.0f, 0.0f}, (vec3_t){-158.0f, 0.0f, 50.0f});
-    scene_add_quad(self, white_mat, (vec3_t){314.0f, 0.0f, 456.0f}, (vec3_t){0.0f, 330.0f, 0.0f}, (vec3_t){-49.0f, 0.0f, -160.0f});
-    scene_add_quad(self, white_mat, (vec3_t){265.0f, 0.0f, 296.0f}, (vec3_t){0.0f, 330.0f, 0.0f}, (vec3_t){158.0f, 0.0f, -49.0f});
+    mat34_from_axes((vec3_t){49.0f, 0.0f, 159.0f}, (vec3_t){0.0f, 330.0f, 0.0f}, (vec3_t){-158.0f, 0.0f, 49.0f}, (vec3_t){423.0f, 0.0f, 247.0f}, &transform);
+    scene_add_instance(self, box, &transform);
+    geometry_release(box);
 
     //scene_add_sphere(self, metal_mat, (vec3_t){w/2, h/2, d/2}, 50.0f);
 
-    BUILD_BVH_TREE(self);
     material_release(black_mat);
     material_release(metal_mat);
     material_release(red_mirror_mat);
@@ -582,19 +1905,532 @@ void scene_cornell_box_init(scene_t* self)
     material_release(light_mat);
 }
 
+bool scene_mesh_init(scene_t* self, const char* path)
+{
+    scene_base_init(self);
+    mesh_t* mesh = mesh_load_obj(path);
+    if (!mesh) return false;
+
+    material_t* mesh_mat = material_lambertian_solid_new((vec3_t){0.7f, 0.7f, 0.7f});
+    texture_t* ground_tex = texture_checkered_solid_new((vec3_t){0.8f, 0.8f, 0.8f}, (vec3_t){0.2f, 0.2f, 0.2f}, 0.25f);
+    material_t* ground_mat = material_lambertian_new(ground_tex);
+
+    geometry_t* geometry = geometry_new();
+    geometry_add_mesh(geometry, mesh, mesh_mat);
+    geometry_build_bvh(geometry);
+
+    // Scale the largest side of the mesh's bounds to 1, centered over the origin and resting on y = 0
+    aabb_t bounds;
+    mesh_bounds(mesh, &bounds);
+    vec3_t extent;
+    vec3_sub(bounds.max, bounds.min, extent);
+    const float scale = 1.0f / fmaxf(fmaxf(extent[0], extent[1]), extent[2]);
+    const vec3_t origin = {
+        -0.5f * scale * (bounds.min[0] + bounds.max[0]),
+        -scale * bounds.min[1],
+        -0.5f * scale * (bounds.min[2] + bounds.max[2])
+    };
+    mat34_t transform;
+    mat34_from_axes((vec3_t){scale, 0.0f, 0.0f}, (vec3_t){0.0f, scale, 0.0f}, (vec3_t){0.0f, 0.0f, scale}, origin, &transform);
+    scene_add_instance(self, geometry, &transform);
+    scene_add_sphere(self, ground_mat, (vec3_t){0.0f, -1000.0f, 0.0f}, 1000.0f);
+
+    const vec3_t camera_pos = {0.0f, 0.8f, 1.9f};
+    const vec3_t target = {0.0f, 0.5f * scale * extent[1], 0.0f};
+    vec3_t forward;
+    vec3_sub(target, camera_pos, forward);
+    camera_init(&self->camera, camera_pos, TO_RADS(15.0f), vec3_norm(forward), 100.0f, (float) PIXEL_WIDTH / PIXEL_HEIGHT, TO_RADS(0.0f));
+    camera_set_forward(&self->camera, forward);
+
+    geometry_release(geometry);
+    material_release(ground_mat);
+    texture_release(ground_tex);
+    material_release(mesh_mat);
+    mesh_release(mesh);
+    return true;
+}
+
 void scene_destroy(scene_t* self)
 {
     for (size_t i = 0; i < self->num_objects; i++)
     {
         scene_object_destroy(&self->objects[i]);
     }
+    free(self->objects);
+#ifdef USE_BVH
+    bvh_destroy(&self->bvh);
+    leaf_prims_destroy(&self->prims);
+#endif
+    free(self->light_objects);
+    free(self->light_cdf);
 }
 
-bool ray_intersect_scene(const ray_t* ray, const scene_t* scene, float tmin, float tmax, ray_hit_t* out)
+static void* replicate_array(const void* src, size_t size)
+{
+    void* dst = alloc_huge_pages(size);
+    memcpy(dst, src, size);
+    return dst;
+}
+
+void scene_replicate(const scene_t* self, scene_t* out)
+{
+    *out = *self;
+    out->objects = replicate_array(self->objects, sizeof(scene_object_t) * self->num_objects);
+    out->capacity = self->num_objects;
+#ifdef USE_BVH
+    const bvh_t* bvh = &self->bvh;
+    out->bvh.nodes = replicate_array(bvh->nodes, sizeof(bvh_node_t) * bvh->num_nodes);
+    out->bvh.prim_indices = replicate_array(bvh->prim_indices, sizeof(uint32_t) * bvh->num_prim_indices);
+#if BVH_WIDTH == 4
+    out->bvh.bvh4_nodes = replicate_array(bvh->bvh4_nodes, sizeof(bvh4_node_t) * bvh->num_bvh4_nodes);
+#endif
+    out->bvh.mapping = NULL;
+    out->bvh.mapping_size = 0;
+
+    const leaf_prims_t* prims = &self->prims;
+    leaf_prims_t* out_prims = &out->prims;
+    out_prims->leaf_indices = replicate_array(prims->leaf_indices, sizeof(uint32_t) * (bvh->num_prim_indices + 1));
+    out_prims->leaves = replicate_array(prims->leaves, sizeof(struct leaf_ranges) * prims->num_leaves);
+    out_prims->sphere_packets = replicate_array(prims->sphere_packets, sizeof(struct sphere_packet) * prims->num_sphere_packets);
+    out_prims->quad_packets = replicate_array(prims->quad_packets, sizeof(struct quad_packet) * prims->num_quad_packets);
+    out_prims->triangles = replicate_array(prims->triangles, sizeof(struct triangle_prim) * prims->num_triangles);
+    out_prims->sphere_objects = replicate_array(prims->sphere_objects, sizeof(uint32_t) * LEAF_PACKET_WIDTH * prims->num_sphere_packets);
+    out_prims->quad_objects = replicate_array(prims->quad_objects, sizeof(uint32_t) * LEAF_PACKET_WIDTH * prims->num_quad_packets);
+    out_prims->triangle_objects = replicate_array(prims->triangle_objects, sizeof(uint32_t) * prims->num_triangles);
+    out_prims->instance_objects = replicate_array(prims->instance_objects, sizeof(uint32_t) * prims->num_instances);
+#endif
+}
+
+void scene_replica_destroy(scene_t* self)
+{
+    // The objects' materials and geometry belong to the original scene
+    free(self->objects);
+#ifdef USE_BVH
+    free(self->bvh.nodes);
+    free(self->bvh.prim_indices);
+#if BVH_WIDTH == 4
+    free(self->bvh.bvh4_nodes);
+#endif
+    leaf_prims_destroy(&self->prims);
+#endif
+}
+
+void scene_reserve(scene_t* self, size_t num_objects)
+{
+    objects_reserve(&self->objects, &self->capacity, num_objects);
+}
+
+uint64_t scene_hash(const scene_t* self, uint64_t hash)
+{
+    const camera_t* cam = &self->camera;
+    hash = hash_bytes(cam->position, sizeof(vec3_t), hash);
+    hash = hash_bytes(cam->forward, sizeof(vec3_t), hash);
+    hash = hash_bytes(cam->up, sizeof(vec3_t), hash);
+    const float lens[] = {cam->fov, cam->near, cam->far, cam->aspect, cam->defocus_radius};
+    hash = hash_bytes(lens, sizeof(lens), hash);
+
+    for (size_t i = 0; i < self->num_objects; i++)
+    {
+        const scene_object_t* object = &self->objects[i];
+        hash = hash_bytes(&object->type, sizeof(object->type), hash);
+        switch (object->type)
+        {
+            case OBJECT_SPHERE:
+                hash = hash_bytes(object->underlying.sphere.center, sizeof(vec3_t), hash);
+                hash = hash_bytes(&object->underlying.sphere.radius, sizeof(float), hash);
+                break;
+            case OBJECT_QUAD:
+                hash = hash_bytes(object->underlying.quad.origin, sizeof(vec3_t), hash);
+                hash = hash_bytes(object->underlying.quad.u, sizeof(vec3_t), hash);
+                hash = hash_bytes(object->underlying.quad.v, sizeof(vec3_t), hash);
+                break;
+            case OBJECT_TRIANGLE:
+            {
+                const float *v0, *v1, *v2;
+                mesh_triangle_vertices(object->underlying.triangle.mesh, object->underlying.triangle.index, &v0, &v1, &v2);
+                hash = hash_bytes(v0, sizeof(vec3_t), hash);
+                hash = hash_bytes(v1, sizeof(vec3_t), hash);
+                hash = hash_bytes(v2, sizeof(vec3_t), hash);
+                break;
+            }
+            case OBJECT_INSTANCE:
+            {
+                const instance_t* instance = &object->underlying.instance;
+                const uint64_t num_objects = instance->geometry->num_objects;
+                hash = hash_bytes(&instance->world_to_object, sizeof(mat34_t), hash);
+                hash = hash_bytes(&num_objects, sizeof(num_objects), hash);
+#ifdef USE_BVH
+                hash = hash_bytes(&instance->geometry->bvh.nodes[0].aabb, sizeof(aabb_t), hash);
+#endif
+                break;
+            }
+        }
+        if (object->material)
+        {
+            hash = material_hash(object->material, hash);
+        }
+    }
+    return hash;
+}
+
+void scene_add_instance(scene_t* self, geometry_t* geometry, const mat34_t* object_to_world)
+{
+    scene_object_instance_init(scene_push_object(self), geometry, object_to_world);
+}
+
+void scene_set_instance_transform(scene_t* self, size_t index, const mat34_t* object_to_world)
+{
+    assert(index < self->num_objects && self->objects[index].type == OBJECT_INSTANCE);
+    const bool invertible = mat34_inverse(object_to_world, &self->objects[index].underlying.instance.world_to_object);
+    assert(invertible);
+    (void) invertible;
+}
+
+// Surface area of a sphere, quad or triangle
+static float scene_object_area(const scene_object_t* self)
+{
+    switch (self->type)
+    {
+        case OBJECT_SPHERE:
+        {
+            const float radius = self->underlying.sphere.radius;
+            return 4.0f * PI * radius * radius;
+        }
+        case OBJECT_QUAD:
+        {
+            vec3_t n;
+            vec3_cross(self->underlying.quad.u, self->underlying.quad.v, n);
+            return vec3_norm(n);
+        }
+        case OBJECT_TRIANGLE:
+        {
+            const float *v0, *v1, *v2;
+            mesh_triangle_vertices(self->underlying.triangle.mesh, self->underlying.triangle.index, &v0, &v1, &v2);
+            vec3_t e1, e2, n;
+            vec3_sub(v1, v0, e1);
+            vec3_sub(v2, v0, e2);
+            vec3_cross(e1, e2, n);
+            return 0.5f * vec3_norm(n);
+        }
+        default:
+            assert(false);
+            return 0.0f;
+    }
+}
+
+// Collects the emissive objects, weighting each by the light it gives off in total
+static void scene_build_lights(scene_t* self)
+{
+    free(self->light_objects);
+    free(self->light_cdf);
+    self->light_objects = NULL;
+    self->light_cdf = NULL;
+    self->num_lights = 0;
+
+    float total_power = 0.0f;
+    for (size_t i = 0; i < self->num_objects; i++)
+    {
+        scene_object_t* object = &self->objects[i];
+        object->light_pdf = 0.0f;
+        vec3_t emission;
+        if (object->type == OBJECT_INSTANCE || !material_emit(object->material, emission)) continue;
+        const float power = vec3_luminance(emission) * scene_object_area(object);
+        if (power <= 0.0f) continue;
+
+        if ((self->num_lights & (self->num_lights - 1)) == 0)
+        {
+            const size_t capacity = self->num_lights ? self->num_lights * 2 : 1;
+            self->light_objects = realloc(self->light_objects, capacity * sizeof(uint32_t));
+            self->light_cdf = realloc(self->light_cdf, capacity * sizeof(float));
+        }
+        total_power += power;
+        object->light_pdf = power;
+        self->light_objects[self->num_lights] = i;
+        self->light_cdf[self->num_lights++] = total_power;
+    }
+
+    for (size_t i = 0; i < self->num_lights; i++)
+    {
+        self->objects[self->light_objects[i]].light_pdf /= total_power;
+        self->light_cdf[i] /= total_power;
+    }
+}
+
+// 1 minus the cosine of the half angle of the cone a sphere of squared radius radius_sq subtends at
+// squared distance distance_sq, in a form that stays accurate for small, distant spheres
+static float sphere_cone_one_minus_cos(float radius_sq, float distance_sq)
+{
+    const float sin_sq = radius_sq / distance_sq;
+    return sin_sq / (1.0f + sqrtf(fmaxf(0.0f, 1.0f - sin_sq)));
+}
+
+static bool sphere_sample_light(const sphere_t* sphere, const vec3_t origin, const float sample[2], light_sample_t* out)
+{
+    vec3_t w;
+    vec3_sub(sphere->center, origin, w);
+    const float distance_sq = vec3_norm_sq(w);
+    const float radius_sq = sphere->radius * sphere->radius;
+    if (distance_sq <= radius_sq) return false;
+    const float distance = sqrtf(distance_sq);
+    vec3_div(w, distance, w);
+
+    // A direction in the cone around w, in a basis with w as its third axis
+    const float one_minus_cos_max = sphere_cone_one_minus_cos(radius_sq, distance_sq);
+    const float cos_theta = 1.0f - sample[0] * one_minus_cos_max;
+    const float sin_theta = sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta));
+    const float phi = 2.0f * PI * sample[1];
+    vec3_t u, v;
+    vec3_orthonormal_basis(w, u, v);
+    vec3_mult(u, cosf(phi) * sin_theta, u);
+    vec3_mult(v, sinf(phi) * sin_theta, v);
+    vec3_mult(w, cos_theta, out->dir);
+    vec3_add(out->dir, u, out->dir);
+    vec3_add(out->dir, v, out->dir);
+
+    // Near side of the sphere along dir
+    out->distance = distance * cos_theta - sqrtf(fmaxf(0.0f, radius_sq - distance_sq * sin_theta * sin_theta));
+    out->pdf = 1.0f / (2.0f * PI * one_minus_cos_max);
+    return true;
+}
+
+// Sets the direction and distance to point and the solid angle pdf of having picked it uniformly from a
+// surface of the given area and normal
+static bool area_sample_light(const vec3_t point, const vec3_t normal, float area, const vec3_t origin, light_sample_t* out)
+{
+    vec3_sub(point, origin, out->dir);
+    const float distance_sq = vec3_norm_sq(out->dir);
+    out->distance = sqrtf(distance_sq);
+    vec3_div(out->dir, out->distance, out->dir);
+    const float cos_light = fabsf(vec3_dot(normal, out->dir));
+    if (cos_light < EPSILON || out->distance < EPSILON) return false;
+    out->pdf = distance_sq / (area * cos_light);
+    return true;
+}
+
+static bool quad_sample_light(const quad_t* quad, float area, const vec3_t origin, const float u[2], light_sample_t* out)
+{
+    vec3_t point, offset;
+    vec3_mult(quad->u, u[0], offset);
+    vec3_add(quad->origin, offset, point);
+    vec3_mult(quad->v, u[1], offset);
+    vec3_add(point, offset, point);
+    return area_sample_light(point, quad->normal, area, origin, out);
+}
+
+static bool triangle_sample_light(const triangle_t* triangle, float area, const vec3_t origin, const float u[2], light_sample_t* out)
+{
+    const float *v0, *v1, *v2;
+    mesh_triangle_vertices(triangle->mesh, triangle->index, &v0, &v1, &v2);
+    vec3_t e1, e2, n;
+    vec3_sub(v1, v0, e1);
+    vec3_sub(v2, v0, e2);
+    vec3_cross(e1, e2, n);
+    vec3_normalize(n, n);
+
+    // Uniform by area, from the square root warp of the unit square onto barycentric coordinates
+    const float s = sqrtf(u[0]);
+    const float t = u[1];
+    vec3_t point;
+    vec3_mult(e1, s * (1.0f - t), e1);
+    vec3_mult(e2, s * t, e2);
+    vec3_add(v0, e1, point);
+    vec3_add(point, e2, point);
+    return area_sample_light(point, n, area, origin, out);
+}
+
+bool scene_sample_light(const scene_t* self, const vec3_t origin, const float u[3], light_sample_t* out)
+{
+    if (self->num_lights == 0) return false;
+
+    // First light whose running sum passes the random number
+    const float choice = u[0];
+    size_t lower = 0, upper = self->num_lights - 1;
+    while (lower < upper)
+    {
+        const size_t mid = (lower + upper) / 2;
+        if (self->light_cdf[mid] <= choice)
+        {
+            lower = mid + 1;
+        }
+        else
+        {
+            upper = mid;
+        }
+    }
+    const scene_object_t* object = &self->objects[self->light_objects[lower]];
+
+    bool sampled;
+    switch (object->type)
+    {
+        case OBJECT_SPHERE:
+            sampled = sphere_sample_light(&object->underlying.sphere, origin, &u[1], out);
+            break;
+        case OBJECT_QUAD:
+            sampled = quad_sample_light(&object->underlying.quad, scene_object_area(object), origin, &u[1], out);
+            break;
+        case OBJECT_TRIANGLE:
+            sampled = triangle_sample_light(&object->underlying.triangle, scene_object_area(object), origin, &u[1], out);
+            break;
+        default:
+            assert(false);
+            sampled = false;
+    }
+    if (!sampled) return false;
+    out->pdf *= object->light_pdf;
+    material_emit(object->material, out->emission);
+    return true;
+}
+
+float scene_light_pdf(const scene_t* self, const vec3_t origin, const ray_hit_t* hit)
+{
+    (void) self;
+    const scene_object_t* object = hit->object;
+    if (!object || object->light_pdf == 0.0f) return 0.0f;
+
+    if (object->type == OBJECT_SPHERE)
+    {
+        const sphere_t* sphere = &object->underlying.sphere;
+        vec3_t to_center;
+        vec3_sub(sphere->center, origin, to_center);
+        const float distance_sq = vec3_norm_sq(to_center);
+        const float radius_sq = sphere->radius * sphere->radius;
+        if (distance_sq <= radius_sq) return 0.0f;
+        return object->light_pdf / (2.0f * PI * sphere_cone_one_minus_cos(radius_sq, distance_sq));
+    }
+
+    vec3_t to_hit;
+    vec3_sub(hit->position, origin, to_hit);
+    const float distance_sq = vec3_norm_sq(to_hit);
+    const float cos_light = fabsf(vec3_dot(hit->normal, to_hit)) / sqrtf(distance_sq);
+    if (cos_light < EPSILON) return 0.0f;
+    return object->light_pdf * distance_sq / (scene_object_area(object) * cos_light);
+}
+
+void scene_build_bvh(scene_t* self)
+{
+#ifdef USE_BVH
+    objects_build_bvh(&self->bvh, self->objects, self->num_objects);
+    leaf_prims_build(&self->prims, self->objects, &self->bvh);
+#endif
+    scene_build_lights(self);
+}
+
+bool scene_refit_bvh(scene_t* self)
+{
+    scene_build_lights(self);
+#ifdef USE_BVH
+    aabb_t* aabbs = malloc(sizeof(aabb_t) * self->num_objects);
+    for (size_t i = 0; i < self->num_objects; i++)
+    {
+        scene_object_update_aabb(&self->objects[i]);
+        aabb_copy(&self->objects[i].aabb, &aabbs[i]);
+    }
+
+    bool rebuilt = false;
+    if (self->num_objects != self->bvh.num_prims ||
+        bvh_refit(&self->bvh, aabbs) > self->bvh.build_sah_cost * BVH_REFIT_MAX_COST_RATIO)
+    {
+        bvh_build(&self->bvh, aabbs, self->num_objects);
+        leaf_prims_build(&self->prims, self->objects, &self->bvh);
+        rebuilt = true;
+    }
+    else
+    {
+        leaf_prims_update(&self->prims, self->objects);
+    }
+    free(aabbs);
+    return rebuilt;
+#else
+    return false;
+#endif
+}
+
+float scene_bvh_sah_cost(const scene_t* self)
+{
+#ifdef USE_BVH
+    return bvh_sah_cost(&self->bvh);
+#else
+    return BVH_INTERSECTION_COST * self->num_objects;
+#endif
+}
+
+float scene_bvh_overlap(const scene_t* self)
+{
+#ifdef USE_BVH
+    return bvh_overlap(&self->bvh);
+#else
+    (void) self;
+    return 0.0f;
+#endif
+}
+
+#ifdef BVH_SPATIAL_SPLITS
+void scene_bvh_spatial_split_stats(const scene_t* self, size_t* out_num_splits, size_t* out_num_refs, float* out_overlap_removed)
+{
+#ifdef USE_BVH
+    *out_num_splits = self->bvh.num_spatial_splits;
+    *out_num_refs = self->bvh.num_prim_indices;
+    *out_overlap_removed = self->bvh.spatial_overlap_removed;
+#else
+    *out_num_splits = 0;
+    *out_num_refs = self->num_objects;
+    *out_overlap_removed = 0.0f;
+#endif
+}
+#endif
+
+#ifdef BVH_STATS
+void scene_bvh_stats(uint64_t* out_rays, uint64_t* out_nodes_visited)
+{
+    *out_rays = atomic_load(&bvh_stats_rays);
+    *out_nodes_visited = atomic_load(&bvh_stats_nodes_visited);
+}
+#endif
+
+static struct object_set scene_object_set(const scene_t* self)
 {
+    struct object_set set = {.objects = self->objects, .num_objects = self->num_objects};
 #ifdef USE_BVH
-    return ray_intersect_bvh(scene, ray, tmin, tmax, out);
+    set.bvh = &self->bvh;
+    set.prims = &self->prims;
+#endif
+    return set;
+}
+
+bool ray_intersect_scene(const ray_t* ray, const scene_t* scene, float tmin, float tmax, ray_hit_t* out)
+{
+    const struct object_set set = scene_object_set(scene);
+    return ray_intersect_object_set(&set, ray, tmin, tmax, out);
+}
+
+bool ray_occluded_scene(const ray_t* ray, const scene_t* scene, float tmin, float tmax)
+{
+    const struct object_set set = scene_object_set(scene);
+    return ray_occluded_object_set(&set, ray, tmin, tmax);
+}
+
+void ray_intersect_scene_packet(const ray_t* rays, size_t num_rays, const scene_t* scene, float tmin, float tmax, ray_hit_t* out, bool* out_found)
+{
+    assert(num_rays <= RAY_PACKET_SIZE);
+#if defined(USE_BVH) && BVH_WIDTH == 4
+    if (num_rays == 0) return;
+    const struct object_set set = scene_object_set(scene);
+    float ray_tmin[RAY_PACKET_SIZE];
+    struct closest_hit closest[RAY_PACKET_SIZE];
+    for (size_t r = 0; r < num_rays; r++)
+    {
+        ray_tmin[r] = tmin;
+        closest[r] = (struct closest_hit){NULL, tmax, false};
+    }
+    ray_intersect_bvh4_packet(&set, rays, num_rays, ray_tmin, closest, out);
+    for (size_t r = 0; r < num_rays; r++)
+    {
+        out_found[r] = closest_hit_finish(&closest[r], &rays[r], &out[r]);
+    }
 #else
-    return ray_intersect_no_bvh(scene, ray, tmin, tmax, out);
-#endif      
-}
\ No newline at end of file
+    for (size_t r = 0; r < num_rays; r++)
+    {
+        out_found[r] = ray_intersect_scene(&rays[r], scene, tmin, tmax, &out[r]);
+    }
+#endif
+}
@@ -3,25 +3,39 @@
 
 #include "camera.h"
 #include "common.h"
+#include "bvh.h"
+#include "mat.h"
+#include "mesh.h"
 
-#define MAX_OBJECTS 16384
-#define MAX_NODES MAX_OBJECTS * 2
-#if MAX_OBJECTS > 64
-    #define USE_BVH
-#endif
+// Comment out to test every object against every ray
+#define USE_BVH
+
+// Largest number of rays ray_intersect_scene_packet takes at once. A multiple of four up to 32, since
+// boxes are tested against four rays at a time and the rays of a packet are tracked in bit masks
+#define RAY_PACKET_SIZE 16
+
+// Spheres and quads in BVH leaves are stored and tested in blocks of this many
+#define LEAF_PACKET_WIDTH 4
 
 struct ray;
 struct ray_hit;
 struct material;
+struct geometry;
+struct leaf_ranges;
+struct sphere_packet;
+struct quad_packet;
+struct triangle_prim;
 typedef struct ray ray_t;
 typedef struct ray_hit ray_hit_t;
 typedef struct material material_t;
+typedef struct geometry geometry_t;
 
 enum scene_object_type
 {
     OBJECT_SPHERE,
     OBJECT_QUAD,
-    OBJECT_TRIANGLE
+    OBJECT_TRIANGLE,
+    OBJECT_INSTANCE
 };
 
 typedef struct sphere
@@ -39,18 +53,45 @@ typedef struct quad
     vec3_t w;
 } quad_t;
 
+// One triangle of a mesh, whose buffers hold its vertices
 typedef struct triangle
 {
-    vec3_t v0;
-    vec3_t v1;
-    vec3_t v2;
+    mesh_t* mesh;
+    uint32_t index;
 } triangle_t;
 
-typedef struct aabb
+// A placement of shared geometry. Rays are moved into the geometry's space with world_to_object and
+// traverse its own BVH, so each instance costs one top-level object regardless of the geometry's size
+typedef struct instance
 {
-    vec3_t min;
-    vec3_t max;
-} aabb_t;
+    mat34_t world_to_object;
+    geometry_t* geometry;
+} instance_t;
+
+#ifdef USE_BVH
+// The primitives of a BVH's leaves, copied into dense arrays per type in leaf order so that each leaf
+// covers one range of every array. Traversal reads only these, and the objects themselves, with their
+// materials and bounds, are only touched to record a hit
+typedef struct leaf_prims
+{
+    // Index into leaves, by the offset into prim_indices of each leaf's first entry
+    uint32_t* leaf_indices;
+    struct leaf_ranges* leaves;
+    struct sphere_packet* sphere_packets;
+    struct quad_packet* quad_packets;
+    struct triangle_prim* triangles;
+    // Index into objects of each sphere and quad lane, triangle and instance
+    uint32_t* sphere_objects;
+    uint32_t* quad_objects;
+    uint32_t* triangle_objects;
+    uint32_t* instance_objects;
+    size_t num_leaves;
+    size_t num_sphere_packets;
+    size_t num_quad_packets;
+    size_t num_triangles;
+    size_t num_instances;
+} leaf_prims_t;
+#endif
 
 typedef struct scene_object
 {
@@ -58,56 +99,160 @@ typedef struct scene_object
     {
         sphere_t sphere;
         quad_t quad;
+        triangle_t triangle;
+        instance_t instance;
     } underlying;
 #ifdef USE_BVH
     aabb_t aabb;
 #endif
+    // NULL for instances, whose hits take the material of the geometry's objects
     material_t* material;
     enum scene_object_type type;
+    // Probability that scene_sample_light picks this object, or 0 if it is not one of the scene's lights
+    float light_pdf;
 } scene_object_t;
 
-
-struct bvh_children
-{
-    uint16_t left;
-    uint16_t right;
-};
-
-struct bvh_leaf
-{
-    uint16_t index;
-};
-
-typedef struct bvh_node
+// Objects in their own coordinate space with a BVH over them, shared by any number of instances.
+// Reference counted like materials
+typedef struct geometry
 {
-    aabb_t aabb;
-    union
-    {
-        struct bvh_children children;
-        struct bvh_leaf leaf;
-    } underlying;
-    bool is_leaf;
-} bvh_node_t;
+    scene_object_t* objects;
+    size_t num_objects;
+    size_t capacity;
+#ifdef USE_BVH
+    bvh_t bvh;
+    leaf_prims_t prims;
+#endif
+    int ref_count;
+} geometry_t;
 
+// Objects are kept in an array that grows as they are added, so the scene's size is only limited by memory
 typedef struct scene
 {
-    scene_object_t objects[MAX_OBJECTS];
+    scene_object_t* objects;
+    size_t num_objects;
+    size_t capacity;
 #ifdef USE_BVH
-    bvh_node_t bvh_nodes[MAX_NODES];
-    size_t num_nodes;
+    bvh_t bvh;
+    leaf_prims_t prims;
 #endif
-    size_t num_objects;
+    // Emissive spheres, quads and triangles among objects, by index, with the running sums of their
+    // probabilities of being sampled. Built with the BVH
+    uint32_t* light_objects;
+    float* light_cdf;
+    size_t num_lights;
     camera_t camera;
 } scene_t;
 
+// A point on a light as seen from a shading point
+typedef struct light_sample
+{
+    vec3_t dir;
+    float distance;
+    vec3_t emission;
+    // Per unit solid angle around dir, including the probability of picking the light
+    float pdf;
+} light_sample_t;
+
+geometry_t* geometry_new(void);
+
+void geometry_add_sphere(geometry_t* self, material_t* material, const vec3_t center, float radius);
+
+void geometry_add_quad(geometry_t* self, material_t* material, const vec3_t origin, const vec3_t u, const vec3_t v);
+
+// Adds every triangle of the mesh with the same material
+void geometry_add_mesh(geometry_t* self, mesh_t* mesh, material_t* material);
+
+// Adds an instance of other geometry, so instances can be nested. other must already be built
+void geometry_add_instance(geometry_t* self, geometry_t* other, const mat34_t* object_to_world);
+
+// Must be called once all objects are added and before the geometry is instanced
+void geometry_build_bvh(geometry_t* self);
+
+geometry_t* geometry_acquire(geometry_t* self);
+
+void geometry_release(geometry_t* self);
+
 void scene_default_init(scene_t* self);
 
 void scene_random_init(scene_t* self);
 
 void scene_cornell_box_init(scene_t* self);
 
+// The mesh in the OBJ file at path, scaled to unit size and standing on a ground plane. Returns false,
+// leaving an empty scene, if the file cannot be loaded
+bool scene_mesh_init(scene_t* self, const char* path);
+
 void scene_destroy(scene_t* self);
 
+// Makes room for num_objects objects in total, so that populating a scene of known size allocates once
+void scene_reserve(scene_t* self, size_t num_objects);
+
+// Picks a light with probability proportional to its area times the luminance it emits, using u[0], then
+// a point on it visible from origin, using u[1] and u[2]: uniformly within the cone a sphere subtends, and
+// uniformly by area on quads and triangles. Returns false if the scene has no lights or origin is inside
+// the sphere picked
+bool scene_sample_light(const scene_t* self, const vec3_t origin, const float u[3], light_sample_t* out);
+
+// The pdf scene_sample_light would have for the point hit by a ray from origin, or 0 if the object hit is
+// not one of the scene's lights. Lights inside instances are never sampled
+float scene_light_pdf(const scene_t* self, const vec3_t origin, const ray_hit_t* hit);
+
+// Copies the objects and acceleration structure of a built scene into new arrays from alloc_huge_pages,
+// for rendering on another NUMA node. The pages are placed on the node of the thread that first writes
+// them, so this should be called from a thread on that node. Materials, meshes, instanced geometry and
+// the light list stay shared with the scene, which must outlive the replica. Release with
+// scene_replica_destroy
+void scene_replicate(const scene_t* self, scene_t* out);
+
+void scene_replica_destroy(scene_t* self);
+
+// Continues hash, as from hash_bytes, over what the scene looks like: its camera, and every object's
+// shape, placement and material. Instanced geometry counts by its number of objects and bounds rather
+// than its contents, so that scenes with many instances hash quickly
+uint64_t scene_hash(const scene_t* self, uint64_t hash);
+
+// Places built geometry into the scene with the given transform, which must be invertible
+void scene_add_instance(scene_t* self, geometry_t* geometry, const mat34_t* object_to_world);
+
+// Moves the instance at index in objects. Takes effect in traversal after scene_refit_bvh
+void scene_set_instance_transform(scene_t* self, size_t index, const mat34_t* object_to_world);
+
+// Builds the acceleration structure over the scene's objects. Must be called after the scene is populated
+// and before it is rendered. Large scenes are built on multiple threads
+void scene_build_bvh(scene_t* self);
+
+// Updates the acceleration structure after objects have moved, for rendering animated sequences. Node
+// bounds are refit in linear time, and the tree is only rebuilt when the refit SAH cost has drifted past
+// BVH_REFIT_MAX_COST_RATIO times the cost at build time, or objects were added. Returns whether it rebuilt
+bool scene_refit_bvh(scene_t* self);
+
+// Expected cost of a ray query under the surface area heuristic, in units of the BVH cost constants
+float scene_bvh_sah_cost(const scene_t* self);
+
+// Surface area shared by sibling BVH boxes relative to the root's, see bvh_overlap
+float scene_bvh_overlap(const scene_t* self);
+
+#ifdef BVH_SPATIAL_SPLITS
+// Number of spatial splits in the BVH, the primitive references in its leaves, and the child overlap the
+// spatial splits removed compared to the best object splits at the same nodes
+void scene_bvh_spatial_split_stats(const scene_t* self, size_t* out_num_splits, size_t* out_num_refs, float* out_overlap_removed);
+#endif
+
+#ifdef BVH_STATS
+// Totals over all BVH queries so far, from every thread
+void scene_bvh_stats(uint64_t* out_rays, uint64_t* out_nodes_visited);
+#endif
+
 bool ray_intersect_scene(const ray_t* ray, const scene_t* scene, float tmin, float tmax, ray_hit_t* out);
 
+// ray_intersect_scene on up to RAY_PACKET_SIZE rays at once, setting out_found[i] to whether rays[i] hit.
+// Coherent rays, such as camera rays through neighbouring pixels, share one traversal of the BVH, which
+// fetches each node once for the whole packet and usually decides it with a single ray's box test
+void ray_intersect_scene_packet(const ray_t* rays, size_t num_rays, const scene_t* scene, float tmin, float tmax, ray_hit_t* out, bool* out_found);
+
+// Any-hit query: whether anything lies along the ray within [tmin, tmax]. Cheaper than ray_intersect_scene
+// since it stops at the first intersection and builds no hit record, which suits shadow and visibility rays
+bool ray_occluded_scene(const ray_t* ray, const scene_t* scene, float tmin, float tmax);
+
 #endif
\ No newline at end of file
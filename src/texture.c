@@ -1,6 +1,7 @@
 #include "texture.h"
 
 #include <assert.h>
+#include "utils.h"
 #include "vec.h"
 
 static void texture_solid_sample(const texture_t* self, float u, float v, const vec3_t pos, vec3_t out)
@@ -88,4 +89,21 @@ void texture_release(texture_t* self)
     {
         texture_destroy(self);
     }
-}
\ No newline at end of file
+}
+
+uint64_t texture_hash(const texture_t* self, uint64_t hash)
+{
+    hash = hash_bytes(&self->type, sizeof(self->type), hash);
+    switch (self->type)
+    {
+        case TEXTURE_SOLID:
+            return hash_bytes(self->underlying.solid.color, sizeof(vec3_t), hash);
+        case TEXTURE_CHECKERED:
+            hash = hash_bytes(&self->underlying.checkered.width, sizeof(float), hash);
+            hash = texture_hash(self->underlying.checkered.textures[0], hash);
+            return texture_hash(self->underlying.checkered.textures[1], hash);
+        default:
+            assert(false);
+            return hash;
+    }
+}
@@ -46,4 +46,8 @@ texture_t* texture_acquire(texture_t* other);
 
 void texture_release(texture_t* self);
 
+// Continues hash, as from hash_bytes, over what the texture looks like, so that equal textures hash alike
+// from run to run
+uint64_t texture_hash(const texture_t* self, uint64_t hash);
+
 #endif
\ No newline at end of file
@@ -1,10 +1,25 @@
+#ifdef __linux__
+// For sched_setaffinity and MADV_HUGEPAGE
+#define _GNU_SOURCE
+#endif
+
 #include "utils.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "vec.h"
 
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
 #pragma pack(push, 1)
 
 struct bitmap_header
@@ -32,6 +47,96 @@ struct dib_header
 
 #pragma pack(pop)
 
+size_t get_num_cpus(void)
+{
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t) count : 1;
+}
+
+size_t* get_affinity_cpus(size_t* count)
+{
+    *count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return NULL;
+
+    size_t* cpus = malloc(CPU_COUNT(&set) * sizeof(size_t));
+    if (!cpus) return NULL;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set)) cpus[(*count)++] = cpu;
+    }
+    return cpus;
+#else
+    return NULL;
+#endif
+}
+
+bool pin_thread_to_cpu(size_t cpu)
+{
+#ifdef __linux__
+    if (cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+size_t get_cpu_numa_node(size_t cpu)
+{
+    size_t node = 0;
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%zu", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) return 0;
+
+    // Each CPU's directory holds a link named after its node
+    const struct dirent* entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char) entry->d_name[4]))
+        {
+            node = strtoul(entry->d_name + 4, NULL, 10);
+            break;
+        }
+    }
+    closedir(dir);
+#else
+    (void) cpu;
+#endif
+    return node;
+}
+
+void* alloc_huge_pages(size_t size)
+{
+    if (size < HUGE_PAGE_SIZE) return malloc(size);
+
+    // aligned_alloc takes a multiple of the alignment
+    const size_t rounded = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void* data = aligned_alloc(HUGE_PAGE_SIZE, rounded);
+#ifdef __linux__
+    if (data) madvise(data, rounded, MADV_HUGEPAGE);
+#endif
+    return data;
+}
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
 bool write_pixels_to_bmp(const vec3_t* pixels, size_t width, size_t height, const char* path)
 {
     FILE* file = fopen(path, "wb");
@@ -93,4 +198,22 @@ bool write_pixels_to_bmp(const vec3_t* pixels, size_t width, size_t height, cons
     fclose(file);
 
     return true;
-}
\ No newline at end of file
+}
+
+bool write_counts_to_bmp(const uint32_t* counts, size_t width, size_t height, const char* path)
+{
+    uint32_t max_count = 1;
+    for (size_t i = 0; i < width * height; i++)
+    {
+        max_count = counts[i] > max_count ? counts[i] : max_count;
+    }
+
+    vec3_t* pixels = malloc(width * height * sizeof(vec3_t));
+    for (size_t i = 0; i < width * height; i++)
+    {
+        vec3_fill(pixels[i], (float) counts[i] / max_count);
+    }
+    const bool success = write_pixels_to_bmp(pixels, width, height, path);
+    free(pixels);
+    return success;
+}
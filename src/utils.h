@@ -45,6 +45,32 @@ static inline int rand_int_in_range(int lower, int upper)
     return lower + pcg32_random() % (upper - lower + 1);
 }
 
+size_t get_num_cpus(void);
+
+// Ids of the CPUs the process may run on, in increasing order, which need not be contiguous when the
+// process is confined to a subset of the machine. The caller frees the array. Returns NULL with a count
+// of 0 where the affinity mask is unavailable
+size_t* get_affinity_cpus(size_t* count);
+
+// Pins the calling thread to one CPU. Returns false where pinning is unsupported or fails, or the id is
+// too large to pin to
+bool pin_thread_to_cpu(size_t cpu);
+
+// NUMA node of the CPU, or 0 where that is unknown
+size_t get_cpu_numa_node(size_t cpu);
+
+// Memory for large read-mostly arrays, backed by transparent huge pages where supported so that walking
+// them takes fewer TLB misses. Aligned at least like malloc and released with free
+void* alloc_huge_pages(size_t size);
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// 64-bit FNV-1a. Pass HASH_SEED to start a hash, or a previous result to continue it over more data
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash);
+
 bool write_pixels_to_bmp(const vec3_t* pixels, size_t width, size_t height, const char* path);
 
+// Writes a count per pixel as a grayscale image, scaled so the largest count is white
+bool write_counts_to_bmp(const uint32_t* counts, size_t width, size_t height, const char* path);
+
 #endif
\ No newline at end of file
@@ -145,6 +145,17 @@ static inline void vec3_max(const vec3_t v1, const vec3_t v2, vec3_t out)
     out[2] = fmaxf(v1[2], v2[2]);
 }
 
+static inline float vec3_max_component(const vec3_t v)
+{
+    return fmaxf(fmaxf(v[0], v[1]), v[2]);
+}
+
+// Perceived brightness of a linear RGB color, with Rec. 709 weights
+static inline float vec3_luminance(const vec3_t v)
+{
+    return 0.2126f * v[0] + 0.7152f * v[1] + 0.0722f * v[2];
+}
+
 static inline void vec3_reciprocal(const vec3_t v, vec3_t out)
 {
     out[0] = 1.0f / v[0];
@@ -193,6 +204,17 @@ static inline void vec3_random_on_unit_hemisphere(const vec3_t normal, vec3_t ou
     }
 }
 
+// Two unit vectors that complete the unit vector n to a right handed orthonormal basis, without branching
+// on n's largest component (Duff et al., "Building an Orthonormal Basis, Revisited")
+static inline void vec3_orthonormal_basis(const vec3_t n, vec3_t out_t, vec3_t out_b)
+{
+    const float sign = copysignf(1.0f, n[2]);
+    const float a = -1.0f / (sign + n[2]);
+    const float b = n[0] * n[1] * a;
+    vec3_set(out_t, 1.0f + sign * n[0] * n[0] * a, sign * b, -sign * n[0]);
+    vec3_set(out_b, b, sign + n[1] * n[1] * a, -n[1]);
+}
+
 static inline bool vec3_is_near_zero(const vec3_t v)
 {
     return 